@@ -1,25 +1,266 @@
-/* access logging writes timestamped info after connection finishes */
+/* access logging writes timestamped info after connection finishes.
+ *
+ * the event loop never touches the log file. log_connection() just copies a
+ * fixed size record into a lock-free ring, and a background writer thread
+ * formats the records and writes them out in large batches. the ring is a
+ * bounded queue where each slot has a sequence number: a producer may fill
+ * slot (pos % size) when its sequence is pos, and publishes it by setting
+ * the sequence to pos + 1. the writer consumes it once it sees pos + 1, and
+ * frees it for the next lap by setting it to pos + size.
+ *
+ * each batch goes out in a single write() of whole lines, so with the log
+ * opened for append, lines from other processes sharing the file (workers,
+ * or the parent's reports) never land in the middle of ours. */
 
 #include "access_log.h"
 
 #define ACCESS_LOG_BUF_SIZE 1024
 
-void                                                                            
-log_connection(FILE *access_log_file, struct client_connection *con) {
+static struct access_log_slot ring[ACCESS_LOG_RING_SIZE];
+static unsigned long enqueue_pos;	/* shared by producers */
+static unsigned long dequeue_pos;	/* writer thread only */
+
+/* records we couldn't queue because the ring was full */
+static unsigned long dropped_records;
+
+static FILE *access_log_file;
+static char *access_log_path;
+
+/* set by the SIGHUP handler, so the writer reopens the log for rotation */
+static volatile sig_atomic_t reopen_requested;
+
+static pthread_t writer_thread;
+
+/* the writer sleeps on this when the ring is empty. it sets writer_idle
+ * before its last look at the ring, and a producer checks it after
+ * publishing, so one of them always sees the other */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wakeup = PTHREAD_COND_INITIALIZER;
+static int writer_idle;
+
+static void* access_log_writer(void*);
+static void wait_for_record(void);
+static int record_ready(void);
+static int take_record(struct access_log_record*);
+static int write_all(int, char*, size_t);
+static int format_record(char*, struct access_log_record*,
+		struct date_clock*);
+static void handle_sighup(int);
+
+/* starts the writer thread for the given (already open) log file. path is
+ * used to reopen the log on SIGHUP, and can be null ptr to never reopen */
+void access_log_start(FILE *file, char *path) {
+
+	struct sigaction sa;
+	unsigned long i;
+
+	access_log_file = file;
+	access_log_path = path;
+
+	for(i = 0; i < ACCESS_LOG_RING_SIZE; i++) {
+		ring[i].sequence = i;
+	}
+
+	/* reopen the log on SIGHUP, so it can be rotated */
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = handle_sighup;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if(sigaction(SIGHUP, &sa, NULL) < 0) {
+		err(1, "installing SIGHUP handler failed");
+	}
+
+	if(pthread_create(&writer_thread, NULL, access_log_writer, NULL)
+			!= 0) {
+		errx(1, "starting access log writer thread failed");
+	}
+}
+
+/* queues a log record for the request on the connection. this never blocks -
+ * if the writer has fallen too far behind, the record is dropped */
+void
+log_connection(struct client_connection *con) {
+
+	struct access_log_slot *slot;
+	struct access_log_record *record;
+	unsigned long pos, sequence;
+	long diff;
+
+	/* claim the next free slot */
+	pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	for(;;) {
+		slot = &ring[pos & (ACCESS_LOG_RING_SIZE - 1)];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		diff = (long)(sequence - pos);
+
+		if(diff == 0) {
+			/* slot is free for this lap, try to take it */
+			if(__atomic_compare_exchange_n(&enqueue_pos, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if(diff < 0) {
+			/* the writer hasn't freed the slot yet - full */
+			__atomic_fetch_add(&dropped_records, 1,
+					__ATOMIC_RELAXED);
+			return;
+		} else {
+			/* another producer took it, go again */
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* fill in the record */
+	record = &slot->record;
+	record->client_addr = con->client_addr;
+	record->time = loop_clock()->time;
+	record->method = con->method;
+	record->resp_code = con->resp_code;
+
+	/* response size is 0 if not a 200 OK */
+	if(con->resp_code != RESPONSE_CODE_OK) {
+		record->resp_size = 0;
+	} else {
+		record->resp_size = con->file_size;
+	}
+
+	record->url_length = con->url_length;
+	if(record->url_length > ACCESS_LOG_URL_MAX_LENGTH) {
+		record->url_length = ACCESS_LOG_URL_MAX_LENGTH;
+	}
+	memcpy(record->url, con->request_buf + con->url_offset,
+			record->url_length);
+
+	/* publish it to the writer, and wake it if it's waiting */
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&writer_idle, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&writer_lock);
+		writer_idle = 0;
+		pthread_cond_signal(&writer_wakeup);
+		pthread_mutex_unlock(&writer_lock);
+	}
+}
+
+/* ---------- writer thread ---------- */
+
+static void* access_log_writer(void *arg) {
+
+	static char batch[ACCESS_LOG_BATCH_SIZE];
+	struct access_log_record record;
+	struct date_clock clock; /* last timestamp we formatted */
+	unsigned long dropped;
+	int len;
+
+	memset(&clock, 0, sizeof(struct date_clock));
+
+	for(;;) {
+		/* format as many queued records as fit into the batch */
+		len = 0;
+		while(len <= ACCESS_LOG_BATCH_SIZE - ACCESS_LOG_BUF_SIZE
+				&& take_record(&record)) {
+			len += format_record(batch + len, &record, &clock);
+		}
+
+		/* note any records we had to drop */
+		dropped = __atomic_exchange_n(&dropped_records, 0,
+				__ATOMIC_RELAXED);
+		if(dropped > 0) {
+			len += snprintf(batch + len, ACCESS_LOG_BATCH_SIZE - len,
+					"# dropped %lu access log records\n",
+					dropped);
+		}
+
+		/* nothing to do, wait for a producer */
+		if(len == 0) {
+			wait_for_record();
+			continue;
+		}
+
+		/* reopen the log if we've been asked to. an idle log can
+		 * wait until there's something to write to it */
+		if(reopen_requested && access_log_path != NULL) {
+			reopen_requested = 0;
+			if(freopen(access_log_path, "a", access_log_file)
+					== NULL) {
+				err(1, "access log file reopen failed");
+			}
+		}
+
+		/* write the whole batch in one go */
+		if(write_all(fileno(access_log_file), batch, len) < 0) {
+			err(1, "error writing access log line");
+		}
+	}
+
+	return NULL;
+}
+
+/* sleeps until a producer publishes a record */
+static void wait_for_record(void) {
+
+	pthread_mutex_lock(&writer_lock);
+
+	__atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while(writer_idle && !record_ready()) {
+		pthread_cond_wait(&writer_wakeup, &writer_lock);
+	}
+	writer_idle = 0;
+
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/* returns 1 iff the next record on the ring has been published */
+static int record_ready(void) {
+
+	struct access_log_slot *slot;
+	unsigned long sequence;
+
+	slot = &ring[dequeue_pos & (ACCESS_LOG_RING_SIZE - 1)];
+	sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+	return (long)(sequence - (dequeue_pos + 1)) >= 0;
+}
+
+/* takes the next published record off the ring. returns 1 iff there was
+ * one */
+static int take_record(struct access_log_record *record) {
+
+	struct access_log_slot *slot;
+
+	if(!record_ready()) {
+		return 0; /* not published yet - empty */
+	}
+
+	slot = &ring[dequeue_pos & (ACCESS_LOG_RING_SIZE - 1)];
+	*record = slot->record;
+
+	/* free the slot for the next lap */
+	__atomic_store_n(&slot->sequence, dequeue_pos + ACCESS_LOG_RING_SIZE,
+			__ATOMIC_RELEASE);
+	dequeue_pos++;
+
+	return 1;
+}
+
+/* formats a log line for a record into buf, which must have at least
+ * ACCESS_LOG_BUF_SIZE bytes of room. records come in time order, so the
+ * timestamp is only formatted when the clock's second changes. returns the
+ * line length */
+static int format_record(char *buf, struct access_log_record *record,
+		struct date_clock *clock) {
 	
- 	char buf[ACCESS_LOG_BUF_SIZE];
 	int len = 0; /* len of chars written */
 	char *empty_field = "-"; /* filler where no con state for field */
 	char *method;
 	int log_response_code = 404; /* default resp code 404 */
 	void *addr; /* socket addr, ipv6 or ipv4 */
-    long response_bytes_size;
-
-	/* zero out buf to start */
-	memset(buf, 0, ACCESS_LOG_BUF_SIZE);
 
 	/* get string of method name */
-	switch(con->parser.method) {
+	switch(record->method) {
 		case HTTP_GET:
 			method = "GET";
 			break;
@@ -31,64 +272,81 @@ log_connection(FILE *access_log_file, struct client_connection *con) {
 	}
 
 	/* unpack ip address (could be ipv6 or ipv4) */
-	addr = &((struct sockaddr_in*)(&con->client_addr))->sin_addr;
+	if(record->client_addr.ss_family == AF_INET6) {
+		addr = &((struct sockaddr_in6*)
+				(&record->client_addr))->sin6_addr;
+	} else {
+		addr = &((struct sockaddr_in*)
+				(&record->client_addr))->sin_addr;
+	}
 
 	/* write ip address */
-	if(inet_ntop(con->client_addr.ss_family, addr, buf + len,
-		sizeof(struct sockaddr_storage)) == NULL) {
+	if(inet_ntop(record->client_addr.ss_family, addr, buf,
+		INET6_ADDRSTRLEN) == NULL) {
 		err(1, "ip address conversion failed during logging");
 	}
 
 	/* since ip address length is variable, jump forward until we get back
 	 * at the end of the string */
-	while(buf[len] != '\0') {
-		len++;
-	}
+	len = strlen(buf);
 
 	/* write space and open bracket */
 	len += snprintf(buf + len, ACCESS_LOG_BUF_SIZE - len, " [");
 
 	/* write timestamp */
-	len += write_rfc1123_date(buf + len, time(NULL),
-			ACCESS_LOG_BUF_SIZE - len);
+	date_clock_set(clock, record->time);
+	memcpy(buf + len, clock->date, clock->date_length);
+	len += clock->date_length;
 
 	/* write close bracket, method name, space */
 	len += snprintf(buf + len, ACCESS_LOG_BUF_SIZE - len, "] \"%s ",
 			method);
 
 	/* write URL, or if no URL use default */
-	if(con->url == NULL) {
+	if(record->url_length == 0) {
 		/* no URL parsed */
 		len += snprintf(buf + len, ACCESS_LOG_BUF_SIZE - len, "%s",
 				empty_field);
 	} else {
-		memcpy(buf + len, con->url, con->url_length);
-		len += con->url_length;
+		memcpy(buf + len, record->url, record->url_length);
+		len += record->url_length;
 	}
 
 	/* write close quote, response code. default response code 404 for
 	 * connections where response was not generated */
-	if(con->resp_code == RESPONSE_CODE_UNINITIALISED) {
-		log_response_code = 404;
-	} else {
-		log_response_code = con->resp_code;
+	if(record->resp_code != RESPONSE_CODE_UNINITIALISED) {
+		log_response_code = record->resp_code;
 	}
 
-    /* response size is 0 if not a 200 OK */
-    if(con->resp_code != RESPONSE_CODE_OK) {
-        response_bytes_size = 0;
-    } else {
-        response_bytes_size = con->file_size;
-    }
-
 	len += snprintf(buf + len, ACCESS_LOG_BUF_SIZE - len, "\" %d %ld\n",
-			log_response_code, response_bytes_size);
+			log_response_code, record->resp_size);
+
+	return len;
+}
+
+/* writes all of buf to fd. a regular file takes it in one write(), but
+ * carry on after a short one rather than lose the rest. returns 0 on
+ * success, -1 on error */
+static int write_all(int fd, char *buf, size_t len) {
 
-	/* terminate string and write log line */
-	buf[len] = '\0';
-	if(fputs(buf, access_log_file) == EOF) {
-		err(1, "error writing access log line");
+	ssize_t written;
+
+	while(len > 0) {
+		written = write(fd, buf, len);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += written;
+		len -= (size_t)written;
 	}
 
-	fflush(access_log_file); /* flush just in case */
+	return 0;
+}
+
+static void handle_sighup(int sig) {
+
+	reopen_requested = 1;
 }
@@ -3,9 +3,42 @@
 
 #include <time.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "listen_loop.h"
 
+/* number of records the log ring can hold, must be a power of 2. if the
+ * writer thread falls this far behind, further records are dropped (and
+ * counted) rather than stalling the event loop */
+#define ACCESS_LOG_RING_SIZE (4096)
+
+/* longer URLs are truncated, so the rest of the line still fits */
+#define ACCESS_LOG_URL_MAX_LENGTH (768)
+
+/* the writer thread formats up to this many bytes of log lines per write */
+#define ACCESS_LOG_BATCH_SIZE (64 * 1024)
+
+/* everything we need to write a log line for a request, copied out of the
+ * connection state so that the connection can carry on without us */
+struct access_log_record {
+	struct sockaddr_storage client_addr;
+	time_t time;
+	enum http_method method;
+	enum response_code resp_code;
+	long resp_size;
+	size_t url_length; /* 0 if no URL parsed */
+	char url[ACCESS_LOG_URL_MAX_LENGTH];
+};
+
+/* a ring slot. the sequence number says whose turn it is to use the slot -
+ * see access_log.c */
+struct access_log_slot {
+	unsigned long sequence;
+	struct access_log_record record;
+};
+
+void access_log_start(FILE*, char*);
 void
-log_connection(FILE*, struct client_connection*);
+log_connection(struct client_connection*);
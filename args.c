@@ -13,6 +13,7 @@ struct cl_args get_args(int argc, char **argv) {
 
 	/* default to no access log */
 	cl_args.access_log_file = NULL;
+	cl_args.access_log_path = NULL;
 
 	/* default to listen on wildcard address */
 	cl_args.address = NULL;
@@ -20,7 +21,52 @@ struct cl_args get_args(int argc, char **argv) {
 	/* default service name is http */
 	cl_args.service_or_port = "http";
 
-	while((opt = getopt(argc, argv, "46da:l:p:")) != -1) {
+	/* default to 100 requests per kept-alive connection, with up to 5
+	 * seconds between them */
+	cl_args.max_keepalive_requests = 100;
+	cl_args.keepalive_timeout = 5;
+
+	/* default to 10 seconds for request headers to arrive, 30 seconds
+	 * without progress sending a response, and 5 seconds for a client
+	 * to close once we're done */
+	cl_args.header_timeout = 10;
+	cl_args.send_timeout = 30;
+	cl_args.linger_timeout = 5;
+
+	/* default to caching up to 256 open files, checking each for changes
+	 * at most once a second */
+	cl_args.file_cache_entries = 256;
+	cl_args.file_cache_valid_secs = 1;
+
+	/* default to holding up to 64MB of small file bodies in memory */
+	cl_args.file_cache_kbytes = 64 * 1024;
+
+	/* default to as many connections as we have fds for, with no
+	 * memory limit */
+	cl_args.max_connections = 0;
+	cl_args.connection_kbytes = 0;
+
+	/* default to shedding new connections once work has been kept
+	 * waiting more than 20 msecs for a while */
+	cl_args.queue_target_msecs = 20;
+
+	/* default to a single event loop in this process */
+	cl_args.workers = 1;
+	cl_args.threads = 1;
+
+	/* default to 4 threads for blocking filesystem work */
+	cl_args.io_threads = 4;
+
+	/* default to running the event loops with epoll where we have it */
+	cl_args.engine = ENGINE_DEFAULT;
+
+	/* default to the system's max listen backlog, and no deferred
+	 * accepts or tcp fast open */
+	cl_args.listen_backlog = SOMAXCONN;
+	cl_args.defer_accept_secs = 0;
+	cl_args.fastopen_queue = 0;
+
+	while((opt = getopt(argc, argv, "46b:c:D:de:a:f:i:j:k:L:l:M:m:n:p:q:r:s:t:v:w:")) != -1) {
 		switch (opt) {
 			case '4':
 				use_ipv4 = 1;
@@ -28,21 +74,134 @@ struct cl_args get_args(int argc, char **argv) {
 			case '6':
 				use_ipv6 = 1;
 				break;
+			case 'b': /* option arg is listen backlog */
+				cl_args.listen_backlog = atoi(optarg);
+				if(cl_args.listen_backlog < 1) {
+					usage();
+				}
+				break;
+			case 'c': /* option arg is max cached open files */
+				cl_args.file_cache_entries = atoi(optarg);
+				if(cl_args.file_cache_entries < 0) {
+					usage();
+				}
+				break;
+			case 'D': /* option arg is deferred accept timeout */
+				cl_args.defer_accept_secs = atoi(optarg);
+				if(cl_args.defer_accept_secs < 0) {
+					usage();
+				}
+				break;
 			case 'd': /* do NOT daemonise */
 				cl_args.daemonise = 0;
 				break;
+			case 'e': /* option arg is event loop engine */
+				if(strcmp(optarg, "libevent") == 0) {
+					cl_args.engine = ENGINE_LIBEVENT;
+				} else if(strcmp(optarg, "epoll") == 0) {
+					cl_args.engine = ENGINE_EPOLL;
+				} else {
+					usage();
+				}
+				break;
 			case 'a': /* option arg is access log filename */
+				cl_args.access_log_path = optarg;
 				cl_args.access_log_file = fopen(optarg, "a");
 				if(cl_args.access_log_file == NULL) {
 					err(1, "access log file open failed");
 				}
 				break;
+			case 'f': /* option arg is tcp fast open queue length */
+				cl_args.fastopen_queue = atoi(optarg);
+				if(cl_args.fastopen_queue < 0) {
+					usage();
+				}
+				break;
+			case 'i': /* option arg is keep-alive idle timeout */
+				cl_args.keepalive_timeout = atoi(optarg);
+				if(cl_args.keepalive_timeout < 1) {
+					usage();
+				}
+				break;
+			case 'j': /* option arg is number of io threads */
+				cl_args.io_threads = atoi(optarg);
+				if(cl_args.io_threads < 0) {
+					usage();
+				}
+				break;
+			case 'k': /* option arg is max requests per
+				     connection */
+				cl_args.max_keepalive_requests = atoi(optarg);
+				if(cl_args.max_keepalive_requests < 1) {
+					usage();
+				}
+				break;
 			case 'l': /* option arg is listen address */
 				cl_args.address = optarg;
 				break;
+			case 'm': /* option arg is file body cache budget */
+				cl_args.file_cache_kbytes = atoi(optarg);
+				if(cl_args.file_cache_kbytes < 0) {
+					usage();
+				}
+				break;
+			case 'M': /* option arg is connection memory budget */
+				cl_args.connection_kbytes = atoi(optarg);
+				if(cl_args.connection_kbytes < 0) {
+					usage();
+				}
+				break;
+			case 'n': /* option arg is max open connections */
+				cl_args.max_connections = atoi(optarg);
+				if(cl_args.max_connections < 0) {
+					usage();
+				}
+				break;
 			case 'p': /* option arg is listen port */
 				cl_args.service_or_port = optarg;
 				break;
+			case 'q': /* option arg is queueing delay target */
+				cl_args.queue_target_msecs = atoi(optarg);
+				if(cl_args.queue_target_msecs < 0) {
+					usage();
+				}
+				break;
+			case 'r': /* option arg is request header timeout */
+				cl_args.header_timeout = atoi(optarg);
+				if(cl_args.header_timeout < 1) {
+					usage();
+				}
+				break;
+			case 's': /* option arg is response send timeout */
+				cl_args.send_timeout = atoi(optarg);
+				if(cl_args.send_timeout < 1) {
+					usage();
+				}
+				break;
+			case 'L': /* option arg is lingering close timeout */
+				cl_args.linger_timeout = atoi(optarg);
+				if(cl_args.linger_timeout < 1) {
+					usage();
+				}
+				break;
+			case 't': /* option arg is number of loop threads */
+				cl_args.threads = atoi(optarg);
+				if(cl_args.threads < 1) {
+					usage();
+				}
+				break;
+			case 'v': /* option arg is file cache validity */
+				cl_args.file_cache_valid_secs = atoi(optarg);
+				if(cl_args.file_cache_valid_secs < 0) {
+					usage();
+				}
+				break;
+			case 'w': /* option arg is number of workers */
+				cl_args.workers = atoi(optarg);
+				if(cl_args.workers < 1) {
+					usage();
+				}
+				break;
 		}
 	}
 
@@ -78,6 +237,14 @@ __dead
 #endif
 void usage(void) {
 	extern char *__progname;
-	fprintf(stderr, "usage: %s [-46d] [-a access.log] [-l address] [-p port] directory\n", __progname);
+	fprintf(stderr, "usage: %s [-46d] [-a access.log] [-b backlog]\n"
+		"\t[-c cached_files] [-D defer_secs] [-e libevent|epoll]\n"
+		"\t[-f fastopen_queue] [-i idle_timeout] [-j io_threads]\n"
+		"\t[-k max_requests] [-L linger_timeout] [-l address]\n"
+		"\t[-M conn_kbytes] [-m cache_kbytes] [-n max_connections]\n"
+		"\t[-p port] [-q queue_target_ms] [-r header_timeout]\n"
+		"\t[-s send_timeout] [-t threads] [-v cache_valid_secs]\n"
+		"\t[-w workers] directory\n",
+		__progname);
 	exit(1);
 }
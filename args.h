@@ -9,15 +9,51 @@
 #include <sys/stat.h>
 #include <err.h>
 
+#include "engine.h"
+
 struct cl_args {
 	int address_family; /* AF_INET or AF_INET6 from socket.h */
 	FILE *access_log_file;	/* null ptr for no access logging */
+	char *access_log_path;	/* so the access log can be reopened */
 	int daemonise;	/* 1 iff we're daemonising, otherwise run foreground */
 			/* note that if running in foreground, access log will
 			   be written to stdout */
 	char *address;	/* listen address. null ptr if use wildcard address */
 	char *service_or_port;	/* listen port number or service name */
 	char *directory;	/* directory to serve files from */
+	int max_keepalive_requests; /* max requests per connection, 1 for no
+				       keep-alive */
+	int keepalive_timeout;	/* seconds to wait for the next request on a
+				   kept-alive connection */
+	int header_timeout;	/* seconds a request's headers may take to
+				   arrive */
+	int send_timeout;	/* seconds a client may go without taking any
+				   of its response */
+	int linger_timeout;	/* seconds to wait for a client to close after
+				   we've shut down our end */
+	int file_cache_entries;	/* max open files to cache, 0 for no cache */
+	int file_cache_valid_secs; /* seconds before a cached file is checked
+				      for changes */
+	int file_cache_kbytes;	/* memory budget for cached small file bodies,
+				   in kilobytes */
+	int max_connections;	/* most open connections, 0 for as many as we
+				   have fds for */
+	int connection_kbytes;	/* memory budget for connection state, in
+				   kilobytes, 0 for no limit */
+	int queue_target_msecs;	/* how long work may wait on a loop before
+				   it sheds new connections, 0 for never */
+	int workers;	/* number of worker processes, 1 to serve from this
+			   process */
+	int threads;	/* number of event loop threads per process */
+	int io_threads;	/* threads for blocking filesystem work, 0 to do it
+			   on the event loop */
+	enum engine_type engine; /* what runs the event loops */
+	int listen_backlog;	/* connections the kernel queues for us */
+	int defer_accept_secs;	/* seconds a new connection may wait for its
+				   request before we're told of it, 0 for
+				   off */
+	int fastopen_queue;	/* pending tcp fast open connections, 0 for
+				   off */
 };
 
 struct cl_args get_args(int, char**);
@@ -0,0 +1,93 @@
+/* bounded lock-free queue of accepted connections.
+ *
+ * this is the same sequence numbered ring as the access log, except that
+ * any number of threads may pop - an event loop queues connections it's too
+ * busy to start, and either it or an idle loop takes them off again. a slot
+ * at pos may be filled when its sequence is pos, is published by setting
+ * the sequence to pos + 1, and is freed for the next lap by setting it to
+ * pos + size once it's been taken. */
+
+#include "conn_queue.h"
+
+void conn_queue_init(struct conn_queue *queue) {
+
+	unsigned long i;
+
+	for(i = 0; i < CONN_QUEUE_SIZE; i++) {
+		queue->slots[i].sequence = i;
+	}
+
+	queue->enqueue_pos = 0;
+	queue->dequeue_pos = 0;
+}
+
+/* adds a connection to the queue. returns 0 if the queue is full */
+int conn_queue_push(struct conn_queue *queue,
+		struct accepted_connection *con) {
+
+	struct conn_queue_slot *slot;
+	unsigned long pos, sequence;
+	long diff;
+
+	pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for(;;) {
+		slot = &queue->slots[pos & (CONN_QUEUE_SIZE - 1)];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		diff = (long)(sequence - pos);
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&queue->enqueue_pos,
+						&pos, pos + 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if(diff < 0) {
+			return 0; /* full */
+		} else {
+			pos = __atomic_load_n(&queue->enqueue_pos,
+					__ATOMIC_RELAXED);
+		}
+	}
+
+	slot->con = *con;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* takes the oldest connection off the queue. returns 0 if it's empty */
+int conn_queue_pop(struct conn_queue *queue,
+		struct accepted_connection *con) {
+
+	struct conn_queue_slot *slot;
+	unsigned long pos, sequence;
+	long diff;
+
+	pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	for(;;) {
+		slot = &queue->slots[pos & (CONN_QUEUE_SIZE - 1)];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		diff = (long)(sequence - (pos + 1));
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&queue->dequeue_pos,
+						&pos, pos + 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if(diff < 0) {
+			return 0; /* empty */
+		} else {
+			pos = __atomic_load_n(&queue->dequeue_pos,
+					__ATOMIC_RELAXED);
+		}
+	}
+
+	*con = slot->con;
+	__atomic_store_n(&slot->sequence, pos + CONN_QUEUE_SIZE,
+			__ATOMIC_RELEASE);
+
+	return 1;
+}
@@ -0,0 +1,34 @@
+/* bounded lock-free queue of accepted connections - header */
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* number of connections a queue can hold, must be a power of 2 */
+#define CONN_QUEUE_SIZE (256)
+
+/* a connection that's been accepted, but not yet started on a loop */
+struct accepted_connection {
+	int fd;
+	struct sockaddr_storage client_addr;
+
+	/* when it was accepted, in monotonic msecs - see timer_now() */
+	long long accepted_at;
+};
+
+/* a queue slot. as with the access log ring, the sequence number says whose
+ * turn it is to use the slot - see conn_queue.c */
+struct conn_queue_slot {
+	unsigned long sequence;
+	struct accepted_connection con;
+};
+
+struct conn_queue {
+	struct conn_queue_slot slots[CONN_QUEUE_SIZE];
+	unsigned long enqueue_pos;
+	unsigned long dequeue_pos;
+};
+
+void conn_queue_init(struct conn_queue*);
+int conn_queue_push(struct conn_queue*, struct accepted_connection*);
+int conn_queue_pop(struct conn_queue*, struct accepted_connection*);
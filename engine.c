@@ -0,0 +1,365 @@
+/* event loop engines.
+ *
+ * the event loop was written against libevent v1, and still uses its style
+ * of events - set an fd, the EV_ flags and a handler, then add and delete
+ * the event as the connection moves through its states. this file lets
+ * those events be run by an engine picked at startup. the libevent engine
+ * just hands them over, with a base per loop thread. the epoll engine (see
+ * engine_epoll.c) waits on the fds itself, and keeps its own timers in a
+ * binary heap here, ordered by deadline. */
+
+#include "engine.h"
+#include "engine_epoll.h"
+
+/* picked at startup, before any loop thread starts */
+static enum engine_type engine;
+
+/* per loop thread state */
+static __thread struct event_base *base;
+static __thread struct loop_event **timer_heap;
+static __thread int timer_count;
+static __thread int timer_capacity;
+static __thread loop_wakeup_fn wakeup_hook;
+static __thread struct event wakeup_tick_event;
+
+static void wakeup_tick(int, short, void*);
+static void timer_heap_swap(int, int);
+static void timer_heap_up(int);
+static void timer_heap_down(int);
+
+/* picks the engine for all loops. returns the engine we got, which is
+ * libevent if the one asked for isn't available here */
+enum engine_type engine_select(enum engine_type requested) {
+
+	engine = ENGINE_LIBEVENT;
+
+#ifdef HAVE_EPOLL
+	if(requested == ENGINE_EPOLL) {
+		if(epoll_available()) {
+			engine = ENGINE_EPOLL;
+		} else {
+			warnx("epoll unavailable, using libevent");
+		}
+	}
+#endif
+
+#ifndef HAVE_EPOLL
+	if(engine != requested) {
+		warnx("engine unavailable, using libevent");
+	}
+#endif
+
+	return engine;
+}
+
+/* sets up the engine for the loop on the calling thread */
+void engine_init(void) {
+
+#ifdef HAVE_EPOLL
+	if(engine == ENGINE_EPOLL) {
+		epoll_engine_init();
+		return;
+	}
+#endif
+
+	base = event_base_new();
+	if(base == NULL) {
+		errx(1, "creating event base failed");
+	}
+}
+
+void loop_event_set(struct loop_event *ev, int fd, short events,
+		loop_event_fn handler, void *arg) {
+
+	ev->fd = fd;
+	ev->events = events;
+	ev->handler = handler;
+	ev->arg = arg;
+	ev->pending = 0;
+	ev->shared = 0;
+	ev->timer_index = -1;
+
+	switch(engine) {
+		case ENGINE_LIBEVENT:
+			event_set(&ev->ev, fd, events, handler, arg);
+			event_base_set(base, &ev->ev);
+			break;
+#ifdef HAVE_EPOLL
+		case ENGINE_EPOLL:
+			epoll_event_set(ev);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+void loop_timer_set(struct loop_event *ev, loop_event_fn handler,
+		void *arg) {
+
+	loop_event_set(ev, -1, 0, handler, arg);
+}
+
+/* marks an fd event, before it's first added, as one of several loops'
+ * events for the same fd - like every loop accepting from one listen
+ * socket. engines that can then wake just one loop when the fd is ready,
+ * rather than all of them. libevent can't, so there it makes no
+ * difference */
+void loop_event_share(struct loop_event *ev) {
+
+	ev->shared = 1;
+}
+
+/* adds the event, with an optional timeout. adding an event that's already
+ * pending just replaces its timeout */
+void loop_event_add(struct loop_event *ev, struct timeval *timeout) {
+
+	ev->pending = 1;
+
+	switch(engine) {
+		case ENGINE_LIBEVENT:
+			event_add(&ev->ev, timeout);
+			break;
+#ifdef HAVE_EPOLL
+		case ENGINE_EPOLL:
+			epoll_event_add(ev);
+			timer_schedule(ev, timeout);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+void loop_event_del(struct loop_event *ev) {
+
+	ev->pending = 0;
+
+	switch(engine) {
+		case ENGINE_LIBEVENT:
+			event_del(&ev->ev);
+			break;
+#ifdef HAVE_EPOLL
+		case ENGINE_EPOLL:
+			epoll_event_del(ev);
+			timer_cancel(ev);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+/* a handler tells us it's read or written everything it can for now, and
+ * got EAGAIN. only the edge triggered epoll engine needs to know */
+void loop_event_blocked(struct loop_event *ev) {
+
+#ifdef HAVE_EPOLL
+	if(engine == ENGINE_EPOLL) {
+		epoll_event_blocked(ev);
+	}
+#else
+	(void)ev;
+#endif
+}
+
+/* calls an event's handler, for engines that run their own. as with
+ * libevent, a persistent event's timeout starts again each time it fires,
+ * and anything else is no longer pending */
+void loop_event_fire(struct loop_event *ev, short what) {
+
+	if(ev->events & EV_PERSIST) {
+		if(ev->timer_index >= 0) {
+			timer_schedule(ev, &ev->timeout);
+		}
+	} else {
+		loop_event_del(ev);
+	}
+
+	ev->handler(ev->fd, what, ev->arg);
+}
+
+/* sets a function to run each time the loop wakes up, before any handlers,
+ * for per loop work that should be done once per wakeup rather than by every
+ * handler. libevent v1 can't tell us when it wakes, so there it's run as each
+ * second starts instead */
+void loop_on_wakeup(loop_wakeup_fn hook) {
+
+	wakeup_hook = hook;
+
+	if(engine == ENGINE_LIBEVENT) {
+		evtimer_set(&wakeup_tick_event, wakeup_tick, NULL);
+		event_base_set(base, &wakeup_tick_event);
+		wakeup_tick(-1, EV_TIMEOUT, NULL);
+	}
+}
+
+/* called by engines that wait themselves, each time they wake up */
+void loop_woken(void) {
+
+	if(wakeup_hook != NULL) {
+		wakeup_hook();
+	}
+}
+
+/* runs the loop on the calling thread. only returns on error */
+int loop_dispatch(void) {
+
+#ifdef HAVE_EPOLL
+	if(engine == ENGINE_EPOLL) {
+		return epoll_dispatch();
+	}
+#endif
+
+	return event_base_dispatch(base);
+}
+
+/* runs the wakeup hook, and sets the timer again for the start of the next
+ * second */
+static void wakeup_tick(int fd, short event, void *arg) {
+
+	struct timeval now, timeout;
+
+	loop_woken();
+
+	gettimeofday(&now, NULL);
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 1000000 - now.tv_usec + WAKEUP_TICK_SLACK_USECS;
+	if(timeout.tv_usec >= 1000000) {
+		timeout.tv_sec = 1;
+		timeout.tv_usec -= 1000000;
+	}
+
+	evtimer_add(&wakeup_tick_event, &timeout);
+}
+
+/* ---------- timers ---------- */
+
+/* ms on the monotonic clock */
+long long timer_now(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* (re)schedules the event's timeout, or cancels it if timeout is null ptr.
+ * if the heap can't grow, the event just goes without a timeout */
+void timer_schedule(struct loop_event *ev, struct timeval *timeout) {
+
+	struct loop_event **new_heap;
+
+	timer_cancel(ev);
+
+	if(timeout == NULL) {
+		return;
+	}
+
+	if(timer_count == timer_capacity) {
+		new_heap = realloc(timer_heap, sizeof(struct loop_event*)
+				* (timer_capacity == 0 ? 64
+					: timer_capacity * 2));
+		if(new_heap == NULL) {
+			return;
+		}
+		timer_heap = new_heap;
+		timer_capacity = timer_capacity == 0 ? 64 : timer_capacity * 2;
+	}
+
+	ev->timeout = *timeout;
+	ev->deadline = timer_now() + timeout->tv_sec * 1000
+		+ timeout->tv_usec / 1000;
+
+	ev->timer_index = timer_count;
+	timer_heap[timer_count++] = ev;
+	timer_heap_up(ev->timer_index);
+}
+
+void timer_cancel(struct loop_event *ev) {
+
+	int i = ev->timer_index;
+
+	if(i < 0) {
+		return;
+	}
+
+	ev->timer_index = -1;
+	timer_count--;
+
+	/* fill the hole with the last event, and restore the heap order */
+	if(i != timer_count) {
+		timer_heap[i] = timer_heap[timer_count];
+		timer_heap[i]->timer_index = i;
+		timer_heap_up(i);
+		timer_heap_down(timer_heap[i]->timer_index);
+	}
+}
+
+/* ms until the next timeout, or -1 if there are none */
+int timer_next_wait(void) {
+
+	long long wait;
+
+	if(timer_count == 0) {
+		return -1;
+	}
+
+	wait = timer_heap[0]->deadline - timer_now();
+
+	return wait < 0 ? 0 : (int)wait;
+}
+
+/* calls the handlers of events whose timeouts have passed */
+void timer_run_expired(void) {
+
+	long long now = timer_now();
+
+	while(timer_count > 0 && timer_heap[0]->deadline <= now) {
+		loop_event_fire(timer_heap[0], EV_TIMEOUT);
+	}
+}
+
+static void timer_heap_swap(int a, int b) {
+
+	struct loop_event *ev = timer_heap[a];
+
+	timer_heap[a] = timer_heap[b];
+	timer_heap[b] = ev;
+	timer_heap[a]->timer_index = a;
+	timer_heap[b]->timer_index = b;
+}
+
+static void timer_heap_up(int i) {
+
+	while(i > 0 && timer_heap[(i - 1) / 2]->deadline
+			> timer_heap[i]->deadline) {
+		timer_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timer_heap_down(int i) {
+
+	int child;
+
+	for(;;) {
+		child = i * 2 + 1;
+		if(child >= timer_count) {
+			return;
+		}
+
+		if(child + 1 < timer_count && timer_heap[child + 1]->deadline
+				< timer_heap[child]->deadline) {
+			child++;
+		}
+
+		if(timer_heap[i]->deadline <= timer_heap[child]->deadline) {
+			return;
+		}
+
+		timer_heap_swap(i, child);
+		i = child;
+	}
+}
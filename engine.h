@@ -0,0 +1,79 @@
+/* event loop engines - header */
+#pragma once
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <event.h>
+
+/* epoll is linux only */
+#ifdef __linux__
+#define HAVE_EPOLL
+#endif
+
+enum engine_type {
+	ENGINE_LIBEVENT = 0,
+	ENGINE_EPOLL
+};
+
+/* the engine used unless another is asked for */
+#ifdef HAVE_EPOLL
+#define ENGINE_DEFAULT ENGINE_EPOLL
+#else
+#define ENGINE_DEFAULT ENGINE_LIBEVENT
+#endif
+
+typedef void (*loop_event_fn)(int, short, void*);
+typedef void (*loop_wakeup_fn)(void);
+
+/* with libevent, the wakeup hook is run from a timer as each second starts,
+ * this long after it, so that time() has moved on too */
+#define WAKEUP_TICK_SLACK_USECS (10000)
+
+/* an fd or timer event. these are used just like libevent v1 events, with
+ * the same EV_ flags and handler arguments, but are run by whichever engine
+ * was selected at startup */
+struct loop_event {
+	int fd;		/* -1 for a timer */
+	short events;	/* EV_READ, EV_WRITE and EV_PERSIST */
+	loop_event_fn handler;
+	void *arg;
+	int pending;	/* 1 iff added */
+
+	/* 1 iff other loops have events for the same fd, and only one of
+	 * them needs waking each time it's ready. see loop_event_share() */
+	int shared;
+
+	/* the libevent engine just wraps a libevent event */
+	struct event ev;
+
+	/* other engines keep their own timers. deadline is in ms on the
+	 * monotonic clock, and timer_index is the event's place in the timer
+	 * heap, or -1 if it has no timeout */
+	struct timeval timeout;
+	long long deadline;
+	int timer_index;
+};
+
+enum engine_type engine_select(enum engine_type);
+void engine_init(void);
+void loop_event_set(struct loop_event*, int, short, loop_event_fn, void*);
+void loop_timer_set(struct loop_event*, loop_event_fn, void*);
+void loop_event_share(struct loop_event*);
+void loop_event_add(struct loop_event*, struct timeval*);
+void loop_event_del(struct loop_event*);
+void loop_event_blocked(struct loop_event*);
+void loop_event_fire(struct loop_event*, short);
+void loop_on_wakeup(loop_wakeup_fn);
+void loop_woken(void);
+int loop_dispatch(void);
+
+/* timers, for engines that keep their own */
+long long timer_now(void);
+void timer_schedule(struct loop_event*, struct timeval*);
+void timer_cancel(struct loop_event*);
+int timer_next_wait(void);
+void timer_run_expired(void);
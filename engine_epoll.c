@@ -0,0 +1,293 @@
+/* edge triggered epoll event loop engine.
+ *
+ * each loop thread has its own epoll set. a connection's fd is registered
+ * for reads, writes and peer hangups once, when its first event is added,
+ * and never modified or removed - closing the fd takes it out of the set.
+ * adding and deleting events as the connection moves between reading and
+ * writing just changes which handlers we'll run here, without a syscall.
+ *
+ * since we're only told about edges, we remember which directions are
+ * ready. an added event whose direction is ready goes on the ready list,
+ * and its handler is run again each time round the loop until it reports
+ * EAGAIN with loop_event_blocked(), so a handler never has to read or
+ * write everything in one go. new fds are assumed ready, which costs at
+ * most one EAGAIN, and means an edge from before the fd was ours can't be
+ * lost.
+ *
+ * an fd that several loops share, like the listen socket, is registered
+ * with EPOLLEXCLUSIVE where the kernel has it, so each new connection wakes
+ * one loop instead of all of them */
+
+#include "engine_epoll.h"
+
+#ifdef HAVE_EPOLL
+
+static __thread int epoll_fd = -1;
+
+/* indexed by fd */
+static __thread struct epoll_fd *fds;
+static __thread int fds_capacity;
+
+/* fds with an added event that's ready to run */
+static __thread int ready_head = -1;
+static __thread int ready_tail = -1;
+
+static struct epoll_fd* get_fd(int);
+static void queue_ready(int);
+static void run_ready(void);
+
+/* 1 iff we can create an epoll set here */
+int epoll_available(void) {
+
+	int fd;
+
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	if(fd < 0) {
+		return 0;
+	}
+
+	close(fd);
+
+	return 1;
+}
+
+/* sets up the epoll set for the calling thread */
+void epoll_engine_init(void) {
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0) {
+		err(1, "creating epoll set failed");
+	}
+}
+
+/* an event is being set up for an fd. if nothing's added for it, it may
+ * be a new fd that's reused the number of one we've closed, so start
+ * over */
+void epoll_event_set(struct loop_event *ev) {
+
+	struct epoll_fd *state;
+
+	if(ev->fd < 0) {
+		return;
+	}
+
+	state = get_fd(ev->fd);
+	if(state == NULL) {
+		errx(1, "allocating epoll fd state failed");
+	}
+
+	if(state->read == NULL && state->write == NULL) {
+		state->ready = EV_READ|EV_WRITE;
+		state->registered = 0;
+	}
+}
+
+void epoll_event_add(struct loop_event *ev) {
+
+	struct epoll_event event;
+	struct epoll_fd *state;
+	int registered = 0;
+
+	if(ev->fd < 0) {
+		return;
+	}
+
+	state = &fds[ev->fd];
+
+	/* register the fd the first time it's used */
+	if(!state->registered) {
+		memset(&event, 0, sizeof(struct epoll_event));
+		event.data.fd = ev->fd;
+
+#ifdef EPOLLEXCLUSIVE
+		/* exclusive wakeups can't be combined with EPOLLRDHUP, and
+		 * older kernels refuse them, in which case every loop gets
+		 * woken after all */
+		if(ev->shared) {
+			event.events = EPOLLIN|EPOLLOUT|EPOLLET|EPOLLEXCLUSIVE;
+			registered = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev->fd,
+					&event) == 0 || errno == EEXIST;
+		}
+#endif
+
+		if(!registered) {
+			event.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev->fd, &event)
+					< 0 && errno != EEXIST) {
+				return; /* the event just never fires */
+			}
+		}
+
+		state->registered = 1;
+	}
+
+	if(ev->events & EV_READ) {
+		state->read = ev;
+	}
+	if(ev->events & EV_WRITE) {
+		state->write = ev;
+	}
+
+	if(state->ready & ev->events) {
+		queue_ready(ev->fd);
+	}
+}
+
+void epoll_event_del(struct loop_event *ev) {
+
+	struct epoll_fd *state;
+
+	if(ev->fd < 0 || ev->fd >= fds_capacity) {
+		return;
+	}
+
+	state = &fds[ev->fd];
+
+	if(state->read == ev) {
+		state->read = NULL;
+	}
+	if(state->write == ev) {
+		state->write = NULL;
+	}
+}
+
+/* the event's handler got EAGAIN, so wait for the next edge */
+void epoll_event_blocked(struct loop_event *ev) {
+
+	if(ev->fd < 0 || ev->fd >= fds_capacity) {
+		return;
+	}
+
+	fds[ev->fd].ready &= ~(ev->events & (EV_READ|EV_WRITE));
+}
+
+/* runs the loop. only returns on error */
+int epoll_dispatch(void) {
+
+	struct epoll_event events[EPOLL_BATCH_SIZE];
+	struct epoll_fd *state;
+	int i, n, wait_ms;
+
+	for(;;) {
+		/* don't sleep if there are handlers still to run */
+		wait_ms = ready_head != -1 ? 0 : timer_next_wait();
+
+		n = epoll_wait(epoll_fd, events, EPOLL_BATCH_SIZE, wait_ms);
+		if(n < 0 && errno != EINTR) {
+			return -1;
+		}
+
+		loop_woken();
+
+		for(i = 0; i < n; i++) {
+			if(events[i].data.fd >= fds_capacity) {
+				continue;
+			}
+
+			state = &fds[events[i].data.fd];
+
+			/* a hangup or error wakes both directions, and the
+			 * handlers find out what happened when they next
+			 * read or write */
+			if(events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP
+						|EPOLLERR)) {
+				state->ready |= EV_READ;
+			}
+			if(events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) {
+				state->ready |= EV_WRITE;
+			}
+
+			if((state->read != NULL && (state->ready & EV_READ))
+					|| (state->write != NULL
+					&& (state->ready & EV_WRITE))) {
+				queue_ready(events[i].data.fd);
+			}
+		}
+
+		run_ready();
+
+		timer_run_expired();
+	}
+}
+
+/* ---------- internals ---------- */
+
+/* the state for an fd, growing the table if we need to */
+static struct epoll_fd* get_fd(int fd) {
+
+	struct epoll_fd *new_fds;
+	int new_capacity;
+
+	if(fd >= fds_capacity) {
+		new_capacity = fds_capacity == 0 ? 1024 : fds_capacity;
+		while(new_capacity <= fd) {
+			new_capacity *= 2;
+		}
+
+		new_fds = realloc(fds, sizeof(struct epoll_fd) * new_capacity);
+		if(new_fds == NULL) {
+			return NULL;
+		}
+
+		memset(new_fds + fds_capacity, 0, sizeof(struct epoll_fd)
+				* (new_capacity - fds_capacity));
+
+		fds = new_fds;
+		fds_capacity = new_capacity;
+	}
+
+	return &fds[fd];
+}
+
+static void queue_ready(int fd) {
+
+	if(fds[fd].queued) {
+		return;
+	}
+
+	fds[fd].queued = 1;
+	fds[fd].next_ready = -1;
+
+	if(ready_tail == -1) {
+		ready_head = fd;
+	} else {
+		fds[ready_tail].next_ready = fd;
+	}
+	ready_tail = fd;
+}
+
+/* runs the handlers for everything on the ready list once. anything that's
+ * still ready afterwards goes back on the list for the next time round, so
+ * one busy connection can't hold up the rest. handlers may add fds and
+ * move the table, so we look up the state again after each one */
+static void run_ready(void) {
+
+	int fd, next;
+
+	fd = ready_head;
+	ready_head = -1;
+	ready_tail = -1;
+
+	while(fd != -1) {
+		next = fds[fd].next_ready;
+		fds[fd].queued = 0;
+
+		if(fds[fd].read != NULL && (fds[fd].ready & EV_READ)) {
+			loop_event_fire(fds[fd].read, EV_READ);
+		}
+
+		if(fds[fd].write != NULL && (fds[fd].ready & EV_WRITE)) {
+			loop_event_fire(fds[fd].write, EV_WRITE);
+		}
+
+		if((fds[fd].read != NULL && (fds[fd].ready & EV_READ))
+				|| (fds[fd].write != NULL
+				&& (fds[fd].ready & EV_WRITE))) {
+			queue_ready(fd);
+		}
+
+		fd = next;
+	}
+}
+
+#endif
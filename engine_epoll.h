@@ -0,0 +1,36 @@
+/* edge triggered epoll event loop engine - header */
+#pragma once
+
+#include "engine.h"
+
+#ifdef HAVE_EPOLL
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* most readiness changes we take from the kernel per epoll_wait() */
+#define EPOLL_BATCH_SIZE (256)
+
+/* what we know about an fd this loop is using. it's registered with the
+ * kernel once, for both directions, and stays registered until it's
+ * closed. edges set ready bits here, and an added event runs for as long
+ * as its direction is ready - until its handler says it got EAGAIN */
+struct epoll_fd {
+	struct loop_event *read;	/* added events, or null ptr */
+	struct loop_event *write;
+	short ready;	/* EV_READ and EV_WRITE */
+	int registered;	/* 1 iff we've added it to the epoll set */
+	int queued;	/* 1 iff on the ready list */
+	int next_ready;
+};
+
+int epoll_available(void);
+void epoll_engine_init(void);
+void epoll_event_set(struct loop_event*);
+void epoll_event_add(struct loop_event*);
+void epoll_event_del(struct loop_event*);
+void epoll_event_blocked(struct loop_event*);
+int epoll_dispatch(void);
+
+#endif
@@ -0,0 +1,478 @@
+/* open file descriptor and metadata cache */
+
+#include "file_cache.h"
+
+/* limits, shared by every loop's cache */
+static int max_entries;	/* 0 if the cache is turned off */
+static int valid_secs;	/* how long an entry is trusted without a stat() */
+static size_t max_body_bytes;	/* budget for cached file bodies */
+
+/* each event loop thread has its own cache, so that they don't need to lock
+ * one. the limits apply to each of them */
+static __thread struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+
+/* least recently used list, for eviction once we're at max_entries */
+static __thread struct file_cache_entry *lru_head;
+static __thread struct file_cache_entry *lru_tail;
+
+static __thread int num_entries;
+
+/* memory used by cached file bodies */
+static __thread size_t body_bytes;
+
+static unsigned long hash_path(const char*, size_t);
+static struct file_cache_entry* find_entry(const char*, size_t,
+		unsigned long);
+static int same_file(struct file_cache_entry*, struct stat*);
+static void lru_unlink(struct file_cache_entry*);
+static void lru_push_head(struct file_cache_entry*);
+static void drop_entry(struct file_cache_entry*);
+static int make_body_room(size_t);
+static void free_entry(struct file_cache_entry*);
+
+/* set the max number of cached files (0 turns the cache off), the number
+ * of seconds an entry is used before it's checked against the filesystem, and
+ * the number of bytes of small file bodies we'll hold in memory */
+void file_cache_init(int entries, int secs, size_t body_budget) {
+
+	max_entries = entries;
+	valid_secs = secs;
+	max_body_bytes = body_budget;
+}
+
+/* look up a full request path. returns a referenced entry that must be given
+ * back with file_cache_release(), or null ptr on a miss. an entry that's
+ * outside its validity window is checked with stat() - if the path now
+ * refers to a different or modified file, the entry is dropped and this is
+ * treated as a miss.
+ *
+ * if stale is given, we don't stat() here. instead *stale is set to 1 iff
+ * the entry needs checking, and the caller must check it (off the event
+ * loop) and report back with file_cache_revalidated() */
+struct file_cache_entry* file_cache_lookup(const char *path, size_t length,
+		time_t now, int *stale) {
+
+	struct file_cache_entry *entry;
+	struct stat file_stat;
+
+	if(max_entries == 0) {
+		return NULL;
+	}
+
+	entry = find_entry(path, length, hash_path(path, length));
+	if(entry == NULL) {
+		return NULL; /* not cached */
+	}
+
+	if(stale != NULL) {
+		*stale = now - entry->validated >= valid_secs;
+	}
+
+	/* revalidate if the entry is too old to trust */
+	if(stale == NULL && now - entry->validated >= valid_secs) {
+		if(stat(entry->path, &file_stat) == -1
+				|| !same_file(entry, &file_stat)) {
+			drop_entry(entry);
+			return NULL;
+		}
+
+		entry->validated = now;
+	}
+
+	/* move to the most recently used end */
+	lru_unlink(entry);
+	lru_push_head(entry);
+
+	entry->refcount++;
+	return entry;
+}
+
+/* like file_cache_lookup() with stale, but only looks. the entry isn't
+ * referenced or made most recently used, so it mustn't be kept */
+const struct file_cache_entry* file_cache_peek(const char *path,
+		size_t length, time_t now, int *stale) {
+
+	struct file_cache_entry *entry;
+
+	if(max_entries == 0) {
+		return NULL;
+	}
+
+	entry = find_entry(path, length, hash_path(path, length));
+	if(entry != NULL) {
+		*stale = now - entry->validated >= valid_secs;
+	}
+
+	return entry;
+}
+
+/* add a newly opened regular file to the cache. on success the cache owns the
+ * fd, and a referenced entry is returned. if the same file is already cached
+ * (say two requests for it missed at once), the fd is closed and the existing
+ * entry is returned instead. returns null ptr if the cache is off or out of
+ * memory, in which case the caller still owns the fd */
+struct file_cache_entry* file_cache_insert(const char *path, size_t length,
+		int fd, struct stat *file_stat, time_t now) {
+
+	struct file_cache_entry *entry;
+	unsigned long hash, bucket;
+
+	if(max_entries == 0) {
+		return NULL;
+	}
+
+	hash = hash_path(path, length);
+
+	entry = find_entry(path, length, hash);
+	if(entry != NULL) {
+		if(same_file(entry, file_stat)) {
+			close(fd);
+
+			entry->validated = now;
+			lru_unlink(entry);
+			lru_push_head(entry);
+
+			entry->refcount++;
+			return entry;
+		}
+
+		/* the path refers to a different file now, replace it */
+		drop_entry(entry);
+	}
+
+	/* make room by dropping the least recently used entry. if it's still
+	 * in use, it's freed once it's released */
+	if(num_entries >= max_entries) {
+		drop_entry(lru_tail);
+	}
+
+	entry = calloc(1, sizeof(struct file_cache_entry));
+	if(entry == NULL) {
+		return NULL;
+	}
+
+	entry->path = malloc(sizeof(char) * (length + 1));
+	if(entry->path == NULL) {
+		free(entry);
+		return NULL;
+	}
+
+	memcpy(entry->path, path, length);
+	entry->path[length] = '\0';
+	entry->path_length = length;
+	entry->hash = hash;
+
+	entry->fd = fd;
+	entry->size = file_stat->st_size;
+	entry->blksize = file_stat->st_blksize;
+	entry->last_modified = file_stat->st_mtime;
+	entry->last_modified_nsec = file_stat->st_mtim.tv_nsec;
+	entry->dev = file_stat->st_dev;
+	entry->ino = file_stat->st_ino;
+	entry->validated = now;
+
+	entry->etag_length = write_etag(entry->etag, entry->ino, entry->size,
+			entry->last_modified, entry->last_modified_nsec);
+
+	/* build the file specific headers once, rather than per response */
+	entry->headers_length = snprintf(entry->headers,
+			FILE_CACHE_HEADERS_SIZE,
+			"Content-Length: %ld\r\nLast-Modified: ",
+			(long)entry->size);
+	entry->headers_length += write_rfc1123_date(
+			entry->headers + entry->headers_length,
+			entry->last_modified,
+			FILE_CACHE_HEADERS_SIZE - entry->headers_length);
+	entry->headers_length += snprintf(
+			entry->headers + entry->headers_length,
+			FILE_CACHE_HEADERS_SIZE - entry->headers_length,
+			"\r\nETag: %s\r\n\r\n", entry->etag);
+
+	entry->refcount = 1;
+	entry->cached = 1;
+
+	/* add to hash bucket and the most recently used end of the list */
+	bucket = entry->hash & (FILE_CACHE_BUCKETS - 1);
+	entry->hash_next = buckets[bucket];
+	buckets[bucket] = entry;
+	lru_push_head(entry);
+
+	num_entries++;
+
+	return entry;
+}
+
+/* reports whether a stale entry from file_cache_lookup() still matches the
+ * file at its path. if it doesn't, the entry is dropped from the cache, and
+ * is freed once the caller releases it */
+void file_cache_revalidated(struct file_cache_entry *entry, int still_valid,
+		time_t now) {
+
+	if(still_valid) {
+		entry->validated = now;
+	} else if(entry->cached) {
+		drop_entry(entry);
+	}
+}
+
+/* makes sure the whole body of a small file is held in memory, evicting the
+ * bodies of the least recently used files that aren't in use if we need to
+ * make room within the memory budget. returns 1 iff entry->body is usable */
+int file_cache_load_body(struct file_cache_entry *entry) {
+
+	ssize_t bytes_read;
+	off_t body_read = 0;
+
+	if(entry->body != NULL) {
+		return 1; /* already loaded */
+	}
+
+	/* only small, non-empty files, and only if there's room */
+	if(entry->size == 0 || entry->size > FILE_CACHE_MAX_BODY_SIZE
+			|| !make_body_room(entry->size)) {
+		return 0;
+	}
+
+	entry->body = malloc(sizeof(char) * entry->size);
+	if(entry->body == NULL) {
+		return 0;
+	}
+
+	/* read until we have the whole body */
+	while(body_read < entry->size) {
+		bytes_read = pread(entry->fd, entry->body + body_read,
+				entry->size - body_read, body_read);
+
+		/* if the file is shorter than we think, or the read fails,
+		 * don't cache it - the entry will be dropped once its stat()
+		 * changes */
+		if(bytes_read <= 0) {
+			free(entry->body);
+			entry->body = NULL;
+			return 0;
+		}
+
+		body_read += bytes_read;
+	}
+
+	body_bytes += entry->size;
+
+	return 1;
+}
+
+/* offers the cache a malloc'd copy of a small file's whole body, read by
+ * the caller. returns 1 iff the cache has taken ownership of it */
+int file_cache_adopt_body(struct file_cache_entry *entry, char *body) {
+
+	if(entry->body != NULL || !entry->cached || entry->size == 0
+			|| entry->size > FILE_CACHE_MAX_BODY_SIZE
+			|| !make_body_room(entry->size)) {
+		return 0;
+	}
+
+	entry->body = body;
+	body_bytes += entry->size;
+
+	return 1;
+}
+
+/* sets aside a body for a small file's entry, within the memory budget, for
+ * the caller to read the whole file into off the loop. returns null ptr if
+ * the body is already loaded or being loaded, or there's no room. the caller
+ * must then report back with file_cache_body_loaded() */
+char* file_cache_reserve_body(struct file_cache_entry *entry) {
+
+	if(entry->body != NULL || entry->body_loading != NULL
+			|| !entry->cached || entry->size == 0
+			|| entry->size > FILE_CACHE_MAX_BODY_SIZE
+			|| !make_body_room(entry->size)) {
+		return NULL;
+	}
+
+	entry->body_loading = malloc(sizeof(char) * entry->size);
+	if(entry->body_loading == NULL) {
+		return NULL;
+	}
+
+	body_bytes += entry->size;
+
+	return entry->body_loading;
+}
+
+/* reports whether a body from file_cache_reserve_body() was read in whole.
+ * if it was, it becomes the entry's body, otherwise it's given back */
+void file_cache_body_loaded(struct file_cache_entry *entry, int loaded) {
+
+	if(loaded) {
+		entry->body = entry->body_loading;
+	} else {
+		free(entry->body_loading);
+		body_bytes -= entry->size;
+	}
+
+	entry->body_loading = NULL;
+}
+
+/* 1 iff file_cache_insert() will cache files */
+int file_cache_enabled(void) {
+
+	return max_entries > 0;
+}
+
+/* give back a reference from file_cache_lookup() or file_cache_insert() */
+void file_cache_release(struct file_cache_entry *entry) {
+
+	entry->refcount--;
+
+	if(entry->refcount == 0 && !entry->cached) {
+		free_entry(entry);
+	}
+}
+
+/* writes the entity tag for a version of a file to a buffer of at least
+ * ETAG_BUF_SIZE, returning the number of chars written. it's made from the
+ * inode, size and last modified time, so it changes whenever the file is
+ * replaced or written to, without our having to read it. the time goes
+ * down to the nanosecond, so that two writes of the same size within a
+ * second still get different tags - it's a strong tag, and those are
+ * different bytes */
+int write_etag(char *buf, ino_t ino, off_t size, time_t last_modified,
+		long last_modified_nsec) {
+
+	return snprintf(buf, ETAG_BUF_SIZE, "\"%lx-%lx-%lx.%lx\"",
+			(unsigned long)ino, (unsigned long)size,
+			(unsigned long)last_modified,
+			(unsigned long)last_modified_nsec);
+}
+
+/* ---------- internals ---------- */
+
+/* FNV-1a */
+static unsigned long hash_path(const char *path, size_t length) {
+
+	unsigned long hash = 2166136261UL;
+	size_t i;
+
+	for(i = 0; i < length; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/* returns the cached entry for a path, or null ptr if there isn't one */
+static struct file_cache_entry* find_entry(const char *path, size_t length,
+		unsigned long hash) {
+
+	struct file_cache_entry *entry;
+
+	for(entry = buckets[hash & (FILE_CACHE_BUCKETS - 1)]; entry != NULL;
+			entry = entry->hash_next) {
+		if(entry->hash == hash && entry->path_length == length
+				&& memcmp(entry->path, path, length) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* 1 iff stat() results are for the same, unmodified file as an entry */
+static int same_file(struct file_cache_entry *entry, struct stat *file_stat) {
+
+	return file_stat->st_dev == entry->dev
+		&& file_stat->st_ino == entry->ino
+		&& file_stat->st_size == entry->size
+		&& file_stat->st_mtime == entry->last_modified
+		&& file_stat->st_mtim.tv_nsec == entry->last_modified_nsec;
+}
+
+static void lru_unlink(struct file_cache_entry *entry) {
+
+	if(entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		lru_head = entry->lru_next;
+	}
+
+	if(entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		lru_tail = entry->lru_prev;
+	}
+
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push_head(struct file_cache_entry *entry) {
+
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+
+	if(lru_head != NULL) {
+		lru_head->lru_prev = entry;
+	} else {
+		lru_tail = entry;
+	}
+
+	lru_head = entry;
+}
+
+/* remove an entry from the cache, freeing it now if nobody is using it */
+static void drop_entry(struct file_cache_entry *entry) {
+
+	struct file_cache_entry **link;
+
+	link = &buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+	while(*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+
+	lru_unlink(entry);
+
+	entry->cached = 0;
+	num_entries--;
+
+	if(entry->refcount == 0) {
+		free_entry(entry);
+	}
+}
+
+/* frees the bodies of the least recently used entries that aren't in use,
+ * until there's room for another body of the given size. returns 1 iff
+ * there's room */
+static int make_body_room(size_t size) {
+
+	struct file_cache_entry *entry;
+
+	if(size > max_body_bytes) {
+		return 0;
+	}
+
+	for(entry = lru_tail; entry != NULL
+			&& body_bytes + size > max_body_bytes;
+			entry = entry->lru_prev) {
+		if(entry->body != NULL && entry->refcount == 0) {
+			free(entry->body);
+			entry->body = NULL;
+			body_bytes -= entry->size;
+		}
+	}
+
+	return body_bytes + size <= max_body_bytes;
+}
+
+static void free_entry(struct file_cache_entry *entry) {
+
+	if(entry->body != NULL) {
+		free(entry->body);
+		body_bytes -= entry->size;
+	}
+
+	close(entry->fd);
+	free(entry->path);
+	free(entry);
+}
@@ -0,0 +1,95 @@
+/* open file descriptor and metadata cache - header */
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "rfc1123_date.h"
+
+/* number of hash buckets, must be a power of 2 */
+#define FILE_CACHE_BUCKETS (4096)
+
+/* files up to this size have their whole body held in memory, within the
+ * cache's memory budget */
+#define FILE_CACHE_MAX_BODY_SIZE (64 * 1024)
+
+/* room for the prebuilt Content-Length, Last-Modified and ETag headers */
+#define FILE_CACHE_HEADERS_SIZE (192)
+
+/* room for an entity tag - four hex numbers, quoted, plus nul */
+#define ETAG_BUF_SIZE (80)
+
+/* a cached open file, keyed by the full request path (serving directory plus
+ * url path). entries are shared between connections and reference counted -
+ * the fd is only closed once the entry has been dropped from the cache and
+ * the last connection using it has released it */
+struct file_cache_entry {
+
+	/* full request path, nul terminated, and its hash */
+	char *path;
+	size_t path_length;
+	unsigned long hash;
+
+	/* the open file, and what fstat() told us about it */
+	int fd;
+	off_t size;
+	int blksize;
+	time_t last_modified;
+	long last_modified_nsec;
+	dev_t dev;
+	ino_t ino;
+
+	/* the file's entity tag, see write_etag() */
+	char etag[ETAG_BUF_SIZE];
+	int etag_length;
+
+	/* prebuilt Content-Length, Last-Modified and ETag headers, including
+	 * the blank line that ends the header block */
+	char headers[FILE_CACHE_HEADERS_SIZE];
+	int headers_length;
+
+	/* the whole file, for small hot files, or null ptr if not loaded */
+	char *body;
+
+	/* a body set aside for an io thread to read the file into, which
+	 * isn't usable until it's done. null ptr if none */
+	char *body_loading;
+
+	/* when we last checked the entry against the filesystem */
+	time_t validated;
+
+	/* number of connections currently using the entry */
+	int refcount;
+
+	/* 1 iff the entry is still in the cache. once it's been dropped, the
+	 * entry is freed when refcount reaches 0 */
+	int cached;
+
+	/* hash bucket chain */
+	struct file_cache_entry *hash_next;
+
+	/* least recently used list, most recently used at the head */
+	struct file_cache_entry *lru_prev;
+	struct file_cache_entry *lru_next;
+};
+
+void file_cache_init(int, int, size_t);
+struct file_cache_entry* file_cache_lookup(const char*, size_t, time_t,
+		int*);
+const struct file_cache_entry* file_cache_peek(const char*, size_t, time_t,
+		int*);
+struct file_cache_entry* file_cache_insert(const char*, size_t, int,
+		struct stat*, time_t);
+void file_cache_revalidated(struct file_cache_entry*, int, time_t);
+int file_cache_load_body(struct file_cache_entry*);
+int file_cache_adopt_body(struct file_cache_entry*, char*);
+char* file_cache_reserve_body(struct file_cache_entry*);
+void file_cache_body_loaded(struct file_cache_entry*, int);
+int file_cache_enabled(void);
+void file_cache_release(struct file_cache_entry*);
+int write_etag(char*, ino_t, off_t, time_t, long);
@@ -4,7 +4,8 @@ int main(int argc, char** argv) {
 
 	struct cl_args cl_args;
 	struct sockaddr_storage listen_addr;
-	int listen_fd;
+	struct worker_stats stats;
+	int listen_fd = -1;
 
 	/* get command line args - this will exit() on bad args error */
 	cl_args = get_args(argc, argv);
@@ -16,8 +17,16 @@ int main(int argc, char** argv) {
 	listen_addr = get_listen_address(cl_args.address_family,
 			cl_args.address, cl_args.service_or_port);
 
-	/* listen on socket, non blocking */
-	listen_fd = setup_listen_socket(&listen_addr);
+	/* apply listen socket tuning from args */
+	set_listen_tuning(cl_args.listen_backlog, cl_args.defer_accept_secs,
+			cl_args.fastopen_queue);
+
+	/* listen on socket, non blocking. workers each get their own */
+	if(cl_args.workers > 1) {
+		workers_listen(&cl_args, &listen_addr);
+	} else {
+		listen_fd = setup_listen_socket(&listen_addr, 0);
+	}
 
 	/* daemonise if required */
 	if(cl_args.daemonise) {
@@ -29,8 +38,12 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	/* start event loop */
-	return listen_loop(cl_args.directory, cl_args.access_log_file,
-			listen_fd);
+	/* start workers, or event loop in this process */
+	if(cl_args.workers > 1) {
+		return run_workers();
+	}
+
+	memset(&stats, 0, sizeof(struct worker_stats));
+	return listen_loop(&cl_args, listen_fd, &stats);
 }
 
@@ -10,5 +10,6 @@
 #include "args.h" /* cl arg parsing */
 #include "listen_loop.h"
 #include "network_setup.h"
+#include "workers.h"
 
 int main(int, char**);
@@ -0,0 +1,174 @@
+/* thread pool for blocking filesystem work.
+ *
+ * anything that might block on the disk (resolving and opening paths,
+ * stat'ing and reading files) would stall every other connection on an event
+ * loop, so it's handed to a pool of io threads instead. jobs are queued to
+ * the io threads under a mutex - they sleep on a condition variable when
+ * there's no work. finished jobs go back to the event loop that submitted
+ * them through that loop's io_completions: a lock-free stack that any io
+ * thread can push onto, plus an eventfd that wakes the loop to pop them all
+ * off again. */
+
+#include "io_pool.h"
+
+static int num_threads;	/* 0 if the pool is off */
+
+/* jobs waiting for an io thread, oldest first */
+static struct io_job *queue_head;
+static struct io_job *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static void* io_thread_main(void*);
+static void complete_job(struct io_job*);
+static void event_handler_completions(int, short, void*);
+
+/* starts the io threads. with 0 threads, the pool is off and callers do
+ * their blocking work themselves */
+void io_pool_start(int threads) {
+
+	pthread_t thread;
+	int i;
+
+	num_threads = threads;
+
+	for(i = 0; i < num_threads; i++) {
+		if(pthread_create(&thread, NULL, io_thread_main, NULL) != 0) {
+			errx(1, "starting io thread failed");
+		}
+	}
+}
+
+int io_pool_enabled(void) {
+
+	return num_threads > 0;
+}
+
+/* sets up the calling thread's event loop to receive finished jobs */
+void io_completions_init(struct io_completions *completions) {
+
+	completions->head = NULL;
+
+#ifdef HAVE_EVENTFD
+	completions->notify_fds[0] = eventfd(0, EFD_NONBLOCK);
+	if(completions->notify_fds[0] < 0) {
+		err(1, "creating io completion eventfd failed");
+	}
+	completions->notify_fds[1] = completions->notify_fds[0];
+#else
+	if(pipe(completions->notify_fds) < 0) {
+		err(1, "creating io completion pipe failed");
+	}
+	set_flags_non_block(completions->notify_fds[0]);
+	set_flags_non_block(completions->notify_fds[1]);
+#endif
+
+	loop_event_set(&completions->event, completions->notify_fds[0],
+			EV_READ|EV_PERSIST, event_handler_completions,
+			completions);
+	loop_event_add(&completions->event, NULL);
+}
+
+/* queues a job for the io threads. its done callback will be called on the
+ * event loop that owns the given completions */
+void io_pool_submit(struct io_job *job, struct io_completions *completions) {
+
+	job->completions = completions;
+	job->next = NULL;
+	job->submitted_at = timer_now();
+
+	pthread_mutex_lock(&queue_lock);
+
+	if(queue_tail != NULL) {
+		queue_tail->next = job;
+	} else {
+		queue_head = job;
+	}
+	queue_tail = job;
+
+	pthread_cond_signal(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* ---------- internals ---------- */
+
+static void* io_thread_main(void *arg) {
+
+	struct io_job *job;
+
+	for(;;) {
+		pthread_mutex_lock(&queue_lock);
+
+		while(queue_head == NULL) {
+			pthread_cond_wait(&queue_ready, &queue_lock);
+		}
+
+		job = queue_head;
+		queue_head = job->next;
+		if(queue_head == NULL) {
+			queue_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&queue_lock);
+
+		job->started_at = timer_now();
+		job->run(job);
+		complete_job(job);
+	}
+
+	return NULL;
+}
+
+/* hands a finished job back to its event loop */
+static void complete_job(struct io_job *job) {
+
+	struct io_completions *completions = job->completions;
+#ifdef HAVE_EVENTFD
+	uint64_t one = 1;
+#endif
+
+	/* push onto the completion stack */
+	job->next = __atomic_load_n(&completions->head, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&completions->head, &job->next,
+				job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* and wake the loop. if the pipe is full, the loop has plenty of
+	 * wakeups pending already */
+#ifdef HAVE_EVENTFD
+	if(write(completions->notify_fds[1], &one, sizeof(uint64_t)) < 0) {
+		return;
+	}
+#else
+	if(write(completions->notify_fds[1], "", 1) < 0) {
+		return;
+	}
+#endif
+}
+
+/* the io threads have finished jobs for this loop */
+static void event_handler_completions(int fd, short event, void *arg) {
+
+	struct io_completions *completions = arg;
+	struct io_job *job, *done = NULL, *next;
+	char buf[64];
+
+	/* clear the wakeup */
+	while(read(fd, buf, sizeof(buf)) > 0);
+	loop_event_blocked(&completions->event);
+
+	/* take everything that's finished. the stack is newest first, so
+	 * reverse it to finish jobs in the order they completed */
+	job = __atomic_exchange_n(&completions->head, NULL, __ATOMIC_ACQUIRE);
+	while(job != NULL) {
+		next = job->next;
+		job->next = done;
+		done = job;
+		job = next;
+	}
+
+	while(done != NULL) {
+		next = done->next;
+		done->done(done);
+		done = next;
+	}
+}
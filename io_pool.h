@@ -0,0 +1,54 @@
+/* thread pool for blocking filesystem work - header */
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+/* on linux, completions wake the event loop through an eventfd. elsewhere
+ * we fall back to a pipe */
+#ifdef __linux__
+#define HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include "network_setup.h"
+#include "engine.h"
+
+struct io_job;
+struct io_completions;
+
+typedef void (*io_job_fn)(struct io_job*);
+
+/* a unit of blocking work. run is called on an io thread, then done is
+ * called back on the event loop that submitted the job. embed this at the
+ * start of a struct holding the job's arguments and results */
+struct io_job {
+	io_job_fn run;
+	io_job_fn done;
+	struct io_completions *completions;
+	struct io_job *next;
+
+	/* when the job was submitted, and when an io thread picked it up, in
+	 * monotonic msecs - see timer_now() */
+	long long submitted_at;
+	long long started_at;
+};
+
+/* jobs that have been run, waiting for their event loop to pick them up.
+ * io threads push onto a lock-free stack, and then poke the notify fd */
+struct io_completions {
+	struct io_job *head;
+	int notify_fds[2];	/* read and write ends, the same eventfd on
+				   linux */
+	struct loop_event event;
+};
+
+void io_pool_start(int);
+int io_pool_enabled(void);
+void io_completions_init(struct io_completions*);
+void io_pool_submit(struct io_job*, struct io_completions*);
@@ -2,6 +2,9 @@
 
 #include "listen_loop.h"
 #include "access_log.h"
+#include "file_cache.h"
+#include "pool.h"
+#include "timer_wheel.h"
 
 /* cheeky file-scope vars to avoid throwing duplicate pointers around for     
  * file serving directory and access log */
@@ -9,34 +12,237 @@ static char *file_serving_directory;
 static int file_serving_directory_len;
 static FILE *access_log_file;
 
-int listen_loop(char *directory, FILE *access_log, int listen_fd) {
-
-	struct event accept_event;
+/* keep-alive limits, also from the command line */
+static int max_keepalive_requests;
+
+/* connection timeouts in seconds, also from the command line. how long we
+ * wait for the next request on a kept-alive connection, for a request's
+ * headers once it's started, for a client to take more of a response, and
+ * for a client to close after we've shut down our end */
+static int keepalive_timeout;
+static int header_timeout;
+static int send_timeout;
+static int linger_timeout;
+
+/* the event loops, and the listen socket they all accept from. these are
+ * set up before any loop thread starts, and not changed after */
+static struct event_loop *loops;
+static int num_loops;
+static int listen_sock;
+
+/* set once we find the kernel can't read without waiting, so we stop
+ * trying */
+static int nowait_unsupported;
+
+/* the most connections this process keeps open at once, and how many it
+ * has open, across all its loops. past the budget, connections are turned
+ * away with a prebuilt 503 */
+static unsigned long max_connections;
+static unsigned long open_connections;
+static char overload_response_start[128];
+static int overload_response_start_length;
+static char overload_response_end[128];
+static int overload_response_end_length;
+
+/* how long, in msecs, work may wait on a loop before it sheds new
+ * connections. 0 to never shed for queueing delay */
+static int queue_target_msecs;
+
+/* counters for all this process's loops */
+static struct worker_stats *stats;
+
+/* the rest is per loop thread. pools for per-connection state and buffers,
+ * so that steady state request handling doesn't malloc. they're trimmed back
+ * every POOL_TRIM_INTERVAL_SECS */
+static __thread struct event_loop *this_loop;
+static __thread struct pool connection_pool;
+static __thread struct pool request_buf_pool;
+static __thread struct pool resp_headers_pool;
+static __thread struct pool io_buf_pool;
+static __thread struct pool linger_pool;
+static __thread struct pool file_job_pool;
+static __thread struct pool warm_job_pool;
+static __thread struct loop_event pool_trim_event;
+
+/* each loop times out its own connections, on a wheel that ticks every
+ * second of the monotonic clock */
+static __thread struct timer_wheel timeouts;
+static __thread struct loop_event timeout_tick_event;
+
+/* re-adds the accept event after we've paused accepting */
+static __thread struct loop_event accept_resume_event;
+
+/* the loop's queueing delay. when the waits we've measured started being
+ * over target (0 if the last one wasn't), and when we last measured one.
+ * overloaded is 1 iff every wait has been over target for at least an
+ * interval, with queued work all along, and there's been no short wait
+ * since */
+static __thread long long above_target_since;
+static __thread long long last_delay_at;
+static __thread int overloaded;
+
+/* state for the next connection we start, allocated before we accept it.
+ * if we can't allocate, connections are left in the backlog rather than
+ * being accepted and then dropped */
+static __thread struct client_connection *spare_connection;
+
+int listen_loop(struct cl_args *cl_args, int listen_fd,
+		struct worker_stats *worker_stats) {
+
+	int i;
+
+	listen_sock = listen_fd;
+	stats = worker_stats;
 
 	/* store file serving directory and its length in file scope global */
-	file_serving_directory = directory;
+	file_serving_directory = cl_args->directory;
 	file_serving_directory_len = strlen(file_serving_directory);
 
-	/* store access log (could be null ptr if logging off) */
-	access_log_file = access_log;
+	/* store access log (could be null ptr if logging off), and start
+	 * the thread that writes it */
+	access_log_file = cl_args->access_log_file;
+	if(access_log_file != NULL) {
+		access_log_start(access_log_file, cl_args->access_log_path);
+	}
+
+	/* set up the open file cache. each loop gets its own */
+	file_cache_init(cl_args->file_cache_entries,
+			cl_args->file_cache_valid_secs,
+			(size_t)cl_args->file_cache_kbytes * 1024);
+
+	/* pick what runs the event loops, before any of them start */
+	engine_select(cl_args->engine);
+
+	/* start the io threads for blocking filesystem work, shared by all
+	 * of this process's loops */
+	io_pool_start(cl_args->io_threads);
+
+	/* store keep-alive request cap and connection timeouts */
+	max_keepalive_requests = cl_args->max_keepalive_requests;
+	keepalive_timeout = cl_args->keepalive_timeout;
+	header_timeout = cl_args->header_timeout;
+	send_timeout = cl_args->send_timeout;
+	linger_timeout = cl_args->linger_timeout;
+
+	/* work out how many connections we can hold, and build the response
+	 * for those we can't, around the date */
+	num_loops = cl_args->threads;
+	max_connections = connection_budget(cl_args);
+	queue_target_msecs = cl_args->queue_target_msecs;
+
+	overload_response_start_length = snprintf(overload_response_start,
+			sizeof(overload_response_start),
+			"HTTP/1.1 %d \r\nDate: ",
+			RESPONSE_CODE_SERVICE_UNAVAILABLE);
+	overload_response_end_length = snprintf(overload_response_end,
+			sizeof(overload_response_end),
+			"\r\nServer: fsmhttp\r\nConnection: close\r\n"
+			"Retry-After: %d\r\nContent-Length: 0\r\n\r\n",
+			OVERLOAD_RETRY_AFTER_SECS);
+
+	/* set up the loops, with a wakeup pipe each if they'll need to steal
+	 * from each other */
+	loops = calloc(num_loops, sizeof(struct event_loop));
+	if(loops == NULL) {
+		err(1, "allocating event loops failed");
+	}
+
+	for(i = 0; i < num_loops; i++) {
+		conn_queue_init(&loops[i].queue);
+
+		if(num_loops > 1) {
+			if(pipe(loops[i].wakeup_fds) < 0) {
+				err(1, "creating loop wakeup pipe failed");
+			}
+			set_flags_non_block(loops[i].wakeup_fds[0]);
+			set_flags_non_block(loops[i].wakeup_fds[1]);
+		}
+	}
+
+	/* start the other loops on their own threads, and run the first one
+	 * on this thread */
+	for(i = 1; i < num_loops; i++) {
+		if(pthread_create(&loops[i].thread, NULL, loop_thread_main,
+					&loops[i]) != 0) {
+			errx(1, "starting event loop thread failed");
+		}
+	}
 
-	/* init libevent */
-	event_init();
+	return run_loop(&loops[0]);
+}
 
-	/* setup event for connection accepts, with no argument */
-	event_set(&accept_event, listen_fd, EV_READ|EV_PERSIST,
+/* runs an event loop on the calling thread. only returns on error */
+int run_loop(struct event_loop *loop) {
+
+	this_loop = loop;
+
+	/* set up pools - request buffers are pooled at their starting size,
+	 * and io buffers hold in-memory bodies and file read chunks */
+	pool_init(&connection_pool, sizeof(struct client_connection));
+	pool_init(&request_buf_pool, REQUEST_HEADER_BUF_START_SIZE);
+	pool_init(&resp_headers_pool, RESPONSE_BUF_SIZE);
+	pool_init(&io_buf_pool, IO_BUF_SIZE);
+	pool_init(&linger_pool, sizeof(struct lingering_connection));
+	pool_init(&file_job_pool, sizeof(struct file_job));
+	pool_init(&warm_job_pool, sizeof(struct file_warm_job));
+
+	/* set up the event engine for this thread */
+	engine_init();
+
+	/* set the loop clock before anything uses it, and bring it up to
+	 * date each time the loop wakes */
+	loop_clock_update();
+	loop_on_wakeup(loop_clock_update);
+
+	/* start the pool trim timer */
+	loop_timer_set(&pool_trim_event, event_handler_pool_trim, NULL);
+	event_handler_pool_trim(-1, EV_TIMEOUT, NULL);
+
+	/* start the connection timeout wheel */
+	timer_wheel_init(&timeouts, timer_now() / 1000);
+	loop_timer_set(&timeout_tick_event, event_handler_timeout_tick, NULL);
+	event_handler_timeout_tick(-1, EV_TIMEOUT, NULL);
+
+	/* setup event for connection accepts. every loop accepts from the
+	 * same listen socket, but only one needs waking for each connection */
+	loop_event_set(&loop->accept_event, listen_sock, EV_READ|EV_PERSIST,
 			event_handler_accept, NULL);
+	loop_event_share(&loop->accept_event);
+
+	/* listen for connection accept events forever, other than pauses
+	 * when we run out of fds */
+	loop_event_add(&loop->accept_event, NULL);
+	loop_timer_set(&accept_resume_event, event_handler_accept_resume,
+			NULL);
+
+	/* listen for the io threads finishing our jobs */
+	if(io_pool_enabled()) {
+		io_completions_init(&loop->io_completions);
+	}
 
-	/* listen for connection accept events forever */
-	event_add(&accept_event, NULL);
+	/* listen for other loops asking us to steal connections */
+	if(num_loops > 1) {
+		loop_event_set(&loop->wakeup_event, loop->wakeup_fds[0],
+				EV_READ|EV_PERSIST, event_handler_wakeup,
+				NULL);
+		loop_event_add(&loop->wakeup_event, NULL);
+	}
 
-	/* start libevent event loop - only exits on error */
-	event_dispatch();
+	/* start the event loop - only exits on error */
+	loop_dispatch();
 
 	/* error? */
 	return -1;
 }
 
+void* loop_thread_main(void *arg) {
+
+	run_loop(arg);
+
+	/* a loop only stops on error, and we can't carry on without it */
+	errx(1, "event loop failed");
+}
+
 /* ---------- request handling ---------- */
 
 /* by this point we know that we've got a HEAD or GET method (we'll need to
@@ -47,32 +253,85 @@ int listen_loop(char *directory, FILE *access_log, int listen_fd) {
  * response */
 void process_request(struct client_connection *con) {
 
+	char req_path[PATH_MAX];
+	size_t req_path_len;
+	enum response_code error_code;
+	time_t now;
+	int stale;
+
+	error_code = request_path(con->request_buf + con->url_offset,
+			con->url_length, req_path, &req_path_len);
+	if(error_code != RESPONSE_CODE_UNINITIALISED) {
+		prepare_error_code_response(con, error_code);
+		return;
+	}
+
+	now = loop_clock()->time;
+
+	/* with io threads, anything that might block on the filesystem is
+	 * left to them, and we wait for them to finish. that's everything
+	 * except a cache hit that doesn't need checking, and whose body we
+	 * don't need to read */
+	if(io_pool_enabled()) {
+		con->file_entry = file_cache_lookup(req_path, req_path_len,
+				now, &stale);
+		use_file_entry(con);
+
+		if(con->file_entry == NULL || stale
+				|| (con->method == HTTP_GET
+					&& con->file_entry->body == NULL
+					&& con->file_entry->size > 0
+					&& con->file_entry->size
+					<= FILE_CACHE_MAX_BODY_SIZE
+					&& !not_modified(con))) {
+			submit_file_job(con, req_path, req_path_len);
+			return;
+		}
+
+		prepare_file_response(con);
+		return;
+	}
+
+	/* hot files are already open in the file cache, which saves us
+	 * resolving the path, opening and stat'ing the file again. otherwise
+	 * open the file, and try to add it to the cache */
+	con->file_entry = file_cache_lookup(req_path, req_path_len, now,
+			NULL);
+
+	if(con->file_entry == NULL && !open_request_file(con, req_path,
+				req_path_len, now)) {
+		return; /* error response already prepared */
+	}
+
+	prepare_file_response(con);
+}
+
+/* maps a request url to the path of the file we serve for it, in req_path,
+ * which is PATH_MAX long. returns RESPONSE_CODE_UNINITIALISED on success, or
+ * the error we should respond with instead */
+enum response_code request_path(const char *url, size_t url_length,
+		char *req_path, size_t *req_path_len) {
+
 	struct http_parser_url parsed_url;
-	char *req_path, *real_path;
 	uint16_t off, len; /* offset and length for parsed url in url buf */
-	struct stat file_stat; /* file status, used for getting sizes */
 
 	/* if URL length is 0, fail */
-	if(con->url_length == 0) {
-		prepare_error_code_response(con, RESPONSE_CODE_BAD_REQ);
-		return;
+	if(url_length == 0) {
+		return RESPONSE_CODE_BAD_REQ;
 	}
 
 	/* try to parse URL using http_parser_parse_url and see if we can find
 	 * the local file */
-	if(http_parser_parse_url(con->url, con->url_length, 0, &parsed_url)
-		       	!= 0) {
+	if(http_parser_parse_url(url, url_length, 0, &parsed_url) != 0) {
 		/* parse failure */
-		prepare_error_code_response(con, RESPONSE_CODE_BAD_REQ);
-		return;
+		return RESPONSE_CODE_BAD_REQ;
 	}
 
 	/* parse was successful - the only thing we care about is the path.
 	 * If there's no path present in the URL, return 404 */
 	if(!(parsed_url.field_set & (1 << UF_PATH))) {
 		/* no path in URL */
-		prepare_error_code_response(con, RESPONSE_CODE_NOT_FOUND);
-		return;
+		return RESPONSE_CODE_NOT_FOUND;
 	}
 
 	/* get offset and length for URL in buf */
@@ -81,116 +340,292 @@ void process_request(struct client_connection *con) {
 
 	/* if path URL length is now 0, fail */
 	if(len == 0) {
-		prepare_error_code_response(con, RESPONSE_CODE_NOT_FOUND);
-		return;
+		return RESPONSE_CODE_NOT_FOUND;
 	}
 
-	/* malloc enough space for the file serving directory prefix,
-	 * the file path (from the parsed URL), and nul terminator */
-	req_path = malloc((sizeof(char) * (file_serving_directory_len + len))
-			+ 1);
-
-	/* on malloc failure, try to return internal server error */
-	if(req_path == NULL) {
-		prepare_error_code_response(con,
-				RESPONSE_CODE_INTERNAL_SERVER_ERROR);
-		return;
+	/* make sure the file serving directory prefix, the file path (from
+	 * the parsed URL), and nul terminator fit in our path buffer. a path
+	 * that long couldn't be opened anyway */
+	if(file_serving_directory_len + len >= PATH_MAX) {
+		return RESPONSE_CODE_NOT_FOUND;
 	}
 
 	/* concat file serving directory and request path */
 	memcpy(req_path, file_serving_directory, file_serving_directory_len);
-	memcpy(req_path + file_serving_directory_len, con->url + off, len);
-	req_path[file_serving_directory_len + len] = '\0';
+	memcpy(req_path + file_serving_directory_len, url + off, len);
+	*req_path_len = file_serving_directory_len + len;
+	req_path[*req_path_len] = '\0';
 
 	/* protect against up directory paths in the trailing path part,
 	 * but not the preceding file serving part of the path */
 	if(strstr(req_path + file_serving_directory_len, "../") != NULL) {
-		free(req_path); /* clean up */
-		prepare_error_code_response(con, RESPONSE_CODE_NOT_FOUND);
-		return;
+		return RESPONSE_CODE_NOT_FOUND;
 	}
 
-	/* get real path (this will follow symlinks for us) - note this is
-	 * malloc'd memory so needs to be free'd */
-	if((real_path = realpath(req_path, NULL)) == NULL) {
-		/* getting real path failed */
-		free(req_path);
+	return RESPONSE_CODE_UNINITIALISED;
+}
 
-		switch(errno) {
-			/* malloc failure in realpath */
-			case ENOMEM:
-				prepare_error_code_response(con,
-						RESPONSE_CODE_INTERNAL_SERVER_ERROR);
-				break;
-			/* path access denied */
-			case EACCES:
-				prepare_error_code_response(con,
-						RESPONSE_CODE_FORBIDDEN);
-				break;
-			/* other failure */
-			default:
-				prepare_error_code_response(con,
-						RESPONSE_CODE_NOT_FOUND);
-		}
+/* once the file is open, get ready to send it */
+void prepare_file_response(struct client_connection *con) {
 
+	use_file_entry(con);
+
+	/* if the client already has this version of the file, tell it so,
+	 * with no body to read or send */
+	if(not_modified(con)) {
+		prepare_error_code_response(con, RESPONSE_CODE_NOT_MODIFIED);
 		return;
 	}
 
-	/* try to open the given file (real path) in read binary mode.
-	 * if it doesn't exist, return 404 */
-	if((con->file_being_sent = fopen(real_path, "rb")) == NULL) {
+	/* small bodies are held in memory, so they can be written together
+	 * with the headers - preferably shared from the file cache, or
+	 * otherwise read up front. HEAD requests don't send a body at all.
+	 * with io threads, any reading has already been done by them, so
+	 * we only use a body that's already in memory */
+	if(con->method == HTTP_GET && con->body == NULL) {
+		if(con->file_entry != NULL
+				&& (con->file_entry->body != NULL
+					|| (!io_pool_enabled()
+						&& file_cache_load_body(
+							con->file_entry)))) {
+			con->body = con->file_entry->body;
+			con->body_length = con->file_size;
+		} else if(!io_pool_enabled()
+				&& con->file_size <= INLINE_BODY_MAX_SIZE) {
+			read_inline_body(con);
+		}
+	}
 
-		free(req_path); /*clean up */
-		free(real_path);
+#ifndef HAVE_SENDFILE
+	/* malloc buffer for file reads of any body that isn't held in memory
+	 * - with sendfile() the kernel copies straight from the page cache,
+	 * so no buffer is needed */
+	if(con->body_length < (size_t)con->file_size) {
+		con->file_read_buf = pool_alloc(&io_buf_pool);
 
-		/* if access denied, return forbidden */
-		if(errno == EACCES) {
-			prepare_error_code_response(con,
-					RESPONSE_CODE_FORBIDDEN);
-		} else {
-			/* other error, presume not found */
+		/* on malloc failure, return internal server error */
+		if(con->file_read_buf == NULL) {
 			prepare_error_code_response(con,
-					RESPONSE_CODE_NOT_FOUND);
+					RESPONSE_CODE_INTERNAL_SERVER_ERROR);
+			return;
 		}
+	}
+#endif
 
-		return;
+	/* update state to indicate we're in a valid file sending state */
+	con->status = SENDING_RESPONSE_FILE;
+
+	/* update response code to 'OK' because we're sending the file */
+	con->resp_code = RESPONSE_CODE_OK;
+}
+
+/* take the file details from the file cache entry, if we've got one */
+void use_file_entry(struct client_connection *con) {
+
+	if(con->file_entry != NULL) {
+		con->file_fd = con->file_entry->fd;
+		con->file_size = con->file_entry->size;
+		con->file_read_size = con->file_entry->blksize;
+		con->file_last_modified = con->file_entry->last_modified;
+		con->file_last_modified_nsec =
+			con->file_entry->last_modified_nsec;
+		con->file_ino = con->file_entry->ino;
+	}
+}
+
+int open_request_file(struct client_connection *con, char *req_path,
+		size_t req_path_len, time_t now) {
+
+	struct stat file_stat; /* file status, used for getting sizes */
+	int fd;
+
+	if((fd = open_file(req_path, &file_stat)) == -1) {
+		prepare_file_error_response(con, errno);
+		return 0;
+	}
+
+	return set_request_file(con, req_path, req_path_len, fd, &file_stat,
+			now);
+}
+
+/* resolves, opens and stats a path. returns the open fd, or -1 with errno
+ * set. this can block on the disk, so with io threads it's only called on
+ * them */
+int open_file(const char *path, struct stat *file_stat) {
+
+	char *real_path;
+	int fd, open_errno;
+
+	/* get real path (this will follow symlinks for us) - note this is
+	 * malloc'd memory so needs to be free'd */
+	if((real_path = realpath(path, NULL)) == NULL) {
+		return -1;
 	}
 
-	/* by this point we no longer need the paths */
-	free(req_path);
+	/* try to open the given file (real path) read only */
+	fd = open(real_path, O_RDONLY);
+	open_errno = errno;
+
+	/* by this point we no longer need the real path */
 	free(real_path);
 
+	if(fd == -1) {
+		errno = open_errno;
+		return -1;
+	}
+
 	/* get file size, optimal read size and last modified date of the
 	 * REAL path */
-	fstat(fileno(con->file_being_sent), &file_stat);
-	con->file_size = file_stat.st_size;
-	con->file_read_size = file_stat.st_blksize;
-	con->file_last_modified = file_stat.st_mtim.tv_sec;
+	if(fstat(fd, file_stat) == -1) {
+		open_errno = errno;
+		close(fd);
+		errno = open_errno;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* prepares the error response for a file we couldn't open */
+void prepare_file_error_response(struct client_connection *con, int error) {
+
+	switch(error) {
+		/* malloc failure in realpath */
+		case ENOMEM:
+			prepare_error_code_response(con,
+					RESPONSE_CODE_INTERNAL_SERVER_ERROR);
+			break;
+		/* path access denied */
+		case EACCES:
+			prepare_error_code_response(con,
+					RESPONSE_CODE_FORBIDDEN);
+			break;
+		/* other failure, presume not found */
+		default:
+			prepare_error_code_response(con,
+					RESPONSE_CODE_NOT_FOUND);
+	}
+}
+
+/* takes on a newly opened file for the request. returns 0 if it can't be
+ * served, with the error response prepared */
+int set_request_file(struct client_connection *con, const char *req_path,
+		size_t req_path_len, int fd, struct stat *file_stat,
+		time_t now) {
+
+	con->file_fd = fd;
+	con->file_size = file_stat->st_size;
+	con->file_read_size = file_stat->st_blksize;
+	con->file_last_modified = file_stat->st_mtim.tv_sec;
+	con->file_last_modified_nsec = file_stat->st_mtim.tv_nsec;
+	con->file_ino = file_stat->st_ino;
 
 	/* only serve real files */
-	if(!S_ISREG(file_stat.st_mode)) {
+	if(!S_ISREG(file_stat->st_mode)) {
 		/* not a regular file */
 		prepare_error_code_response(con, RESPONSE_CODE_NOT_FOUND);
-		return;
+		return 0;
 	}
 
-	/* malloc buffer for file reads */
-	con->file_read_buf = malloc(sizeof(char) * con->file_read_size);
+	/* hand the fd over to the file cache, keyed by the request path, so
+	 * that later requests for it can skip all of the above */
+	con->file_entry = file_cache_insert(req_path, req_path_len,
+			con->file_fd, file_stat, now);
 
-	/* on malloc failure, return internal server error */
-	if(con->file_read_buf == NULL) {
-		free(req_path);
-		free(real_path);
-		prepare_error_code_response(con,
-				RESPONSE_CODE_INTERNAL_SERVER_ERROR);
-		return;
+	return 1;
+}
+
+void release_file(struct client_connection *con) {
+
+	if(con->file_entry != NULL) {
+		file_cache_release(con->file_entry);
+		con->file_entry = NULL;
+	} else if(con->file_fd != -1) {
+		close(con->file_fd);
 	}
 
-	/* update state to indicate we're in a valid file sending state */
-	con->status = SENDING_RESPONSE_FILE;
+	con->file_fd = -1;
+}
 
-	/* update response code to 'OK' because we're sending the file */
-	con->resp_code = RESPONSE_CODE_OK;
+/* 1 iff the client already has the version of the file we'd send. if it
+ * sent If-None-Match, that decides, and any If-Modified-Since is ignored */
+int not_modified(struct client_connection *con) {
+
+	char etag[ETAG_BUF_SIZE];
+	int etag_length;
+
+	if(con->if_none_match_length > 0) {
+		etag_length = file_etag(con, etag);
+		return etag_matches(con->request_buf
+				+ con->if_none_match_offset,
+				con->if_none_match_length, etag, etag_length);
+	}
+
+	return con->if_modified_since != 0
+		&& con->file_last_modified <= con->if_modified_since;
+}
+
+/* 1 iff an If-None-Match list of entity tags, or "*", matches the given
+ * tag. the comparison is weak, so a tag the client has marked W/ matches
+ * ours. anything we can't make sense of doesn't match */
+int etag_matches(const char *list, size_t length, const char *etag,
+		int etag_length) {
+
+	size_t i = 0, start;
+
+	while(i < length) {
+
+		/* skip the separators before the next tag */
+		if(list[i] == ' ' || list[i] == '\t' || list[i] == ',') {
+			i++;
+			continue;
+		}
+
+		if(list[i] == '*') {
+			return 1;
+		}
+
+		if(length - i > 2 && list[i] == 'W' && list[i + 1] == '/') {
+			i += 2;
+		}
+
+		if(list[i] != '"') {
+			return 0;
+		}
+
+		/* the tag runs to its closing quote, quotes included */
+		start = i++;
+		while(i < length && list[i] != '"') {
+			i++;
+		}
+
+		if(i == length) {
+			return 0;
+		}
+
+		i++;
+
+		if(i - start == (size_t)etag_length
+				&& memcmp(list + start, etag, etag_length) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* writes the file's entity tag to a buffer of at least ETAG_BUF_SIZE,
+ * returning its length. it's prebuilt if the file is cached */
+int file_etag(struct client_connection *con, char *buf) {
+
+	if(con->file_entry != NULL) {
+		memcpy(buf, con->file_entry->etag,
+				con->file_entry->etag_length + 1);
+		return con->file_entry->etag_length;
+	}
+
+	return write_etag(buf, con->file_ino, con->file_size,
+			con->file_last_modified, con->file_last_modified_nsec);
 }
 
 void prepare_error_code_response(struct client_connection *con,
@@ -206,178 +641,383 @@ void prepare_error_code_response(struct client_connection *con,
 /* ---------- http-parser callbacks ---------- */
 
 /* since this callback can be called an arbitrary number of times, each of
- * which could have a bit more data, we just store the url pointer and
- * the length each time, and wait for the headers complete callback */
+ * which could have a bit more data, we store the url offset the first time
+ * and add to the length each time, and wait for the message complete
+ * callback. the url goes straight into the pipeline slot for the request
+ * being parsed */
 int on_url_parsed(http_parser *parser, const char *at, size_t length) {
 	
 	struct client_connection *con;
+	struct queued_request *req;
 
 	/* get connection data ptr from parser void ptr */
 	con = parser->data;
+	req = &con->pipeline[(con->pipeline_head + con->pipeline_count)
+		% PIPELINE_MAX_DEPTH];
 
-	/* store current ptr to URL and current length */
-	con->url = at;
-	con->url_length = length;
+	/* the URL is contiguous in the request buffer, so store where it
+	 * starts, and how much of it we've seen so far */
+	if(req->url_length == 0) {
+		req->url_offset = at - con->request_buf;
+	}
+	req->url_length += length;
 
 	return 0; /* return indicating all OK to the parser */
 }
 
-/* called by the parser once we've read all request headers. by this point
- * we should have a URL, and can decide whether there's a file to respond
- * with, or whether we need to return an error code response */
+/* the parser calls these with each part of a request header's field and
+ * value that it finds, which like the url are contiguous in the request
+ * buffer. once the value is followed by another field, or the end of the
+ * headers, the header is complete */
+int on_header_field(http_parser *parser, const char *at, size_t length) {
+
+	struct client_connection *con;
+	con = parser->data;
+
+	if(con->header_in_value) {
+		header_parsed(con);
+	}
+
+	if(con->header_field_length == 0) {
+		con->header_field_offset = at - con->request_buf;
+	}
+	con->header_field_length += length;
+
+	return 0;
+}
+
+int on_header_value(http_parser *parser, const char *at, size_t length) {
+
+	struct client_connection *con;
+	con = parser->data;
+
+	if(con->header_value_length == 0) {
+		con->header_value_offset = at - con->request_buf;
+	}
+	con->header_value_length += length;
+	con->header_in_value = 1;
+
+	return 0;
+}
+
+/* picks out the request headers we act on, storing what we need of them in
+ * the pipeline slot for the request being parsed. the rest are ignored */
+void header_parsed(struct client_connection *con) {
+
+	struct queued_request *req;
+	const char *field, *value;
+	time_t date;
+
+	req = &con->pipeline[(con->pipeline_head + con->pipeline_count)
+		% PIPELINE_MAX_DEPTH];
+	field = con->request_buf + con->header_field_offset;
+	value = con->request_buf + con->header_value_offset;
+
+	if(con->header_field_length == sizeof("If-None-Match") - 1
+			&& strncasecmp(field, "If-None-Match",
+				con->header_field_length) == 0) {
+		req->if_none_match_offset = con->header_value_offset;
+		req->if_none_match_length = con->header_value_length;
+	}
+
+	/* a date we can't parse, or one in the future, is ignored */
+	if(con->header_field_length == sizeof("If-Modified-Since") - 1
+			&& strncasecmp(field, "If-Modified-Since",
+				con->header_field_length) == 0
+			&& parse_rfc1123_date(value, con->header_value_length,
+				&date)
+			&& date <= loop_clock()->time) {
+		req->if_modified_since = date;
+	}
+
+	con->header_field_length = 0;
+	con->header_value_length = 0;
+	con->header_in_value = 0;
+}
+
+/* called by the parser once we've read all request headers. for GET and HEAD
+ * requests we wait for the end of the message. any other method is going to
+ * get an error response, and we don't want to read its body, so queue it now
+ * and stop parsing */
 int on_headers_complete(http_parser *parser) {
 
 	struct client_connection *con;
 	con = parser->data;
 
-	/* headers complete should only happen once, so only continue if
-	 * the current state indicates it hasn't happened already */
-	if(con->status != NEW_CONNECTION_HEADERS_INCOMPLETE) {
-		return 0;
+	if(con->header_in_value) {
+		header_parsed(con);
 	}
 
-	/* set state to indicate headers complete */
-	con->status = HEADERS_COMPLETE;
-	
-	/* if method is not GET or HEAD, fail. otherwise parse the request
-	 * using the URL that we've stored (presumably) from on_url_parsed
-	 * callbacks, and transition the connection status to one of the
-	 * SENDING_ response states */
 	switch(parser->method) {
 		case HTTP_GET:
 		case HTTP_HEAD:
-			process_request(con);
 			break;
 		default:
-			prepare_error_code_response(con,
-					RESPONSE_CODE_METHOD_NOT_ALLOWED);
+			queue_request(con, 0, RESPONSE_CODE_UNINITIALISED);
+			http_parser_pause(parser, 1);
 	}
 
-	/* now that we've processed the request and know how we're responding,
-	 * setup the write event where we'll start sending the request.
-	 * The write event is setup as persistent - we'll need to delete
-	 * it once we've done writing the request and have cleaned up memory
-	 * allocations etc */
-	event_set(&con->ev_write, con->fd, EV_WRITE|EV_PERSIST,
-			event_handler_write, con);
-	event_add(&con->ev_write, NULL); /* add with no timeout */
+	return 0; /* indicate to parser that all is OK */
+}
+
+/* called by the parser once the whole request (including any body) has been
+ * read. we queue the request, and pause the parser here, so that it stops at
+ * the end of this request and we can start it again for the next one */
+int on_message_complete(http_parser *parser) {
+
+	struct client_connection *con;
+	con = parser->data;
+
+	queue_request(con, http_should_keep_alive(parser),
+			RESPONSE_CODE_UNINITIALISED);
+	http_parser_pause(parser, 1);
 
 	return 0; /* indicate to parser that all is OK */
 }
 
 /* ---------- response builders & writers ---------- */
 
-/* read a defined buffer size of data (or a smaller amount) from the
- * file, and write as much of it as possible to the socket. if we write an
- * incomplete buffer (so not all data is successfully written to the socket),
- * then seek the file back so that the unsent data is read again later.
+/* send as much of the remaining file body as the socket will take, starting
+ * at con->file_offset. with sendfile() the data goes straight from the page
+ * cache to the socket. otherwise we pread() a defined buffer size of data
+ * (or a smaller amount) and write as much of it as possible - any unsent
+ * data is simply read again from the same offset later.
  *
  * Returns 1 iff there's still unsent data to be read from the file, otherwise
  * returns 0. */
 int write_file_to_sock(struct client_connection* con) {
 
 	off_t bytes_remaining;
-	int read_size;
-	size_t bytes_read;
 	ssize_t bytes_written;
-	long seek_pos;
-	long seek_back;
-
-	/* get seek position - if getting position failed, just bail out
-	 * and say we're done - it shouldn't fail. */
-	if((seek_pos = ftell(con->file_being_sent)) == -1) {
-		return 0; /* indicate that we're done writing */
-	}
+#ifndef HAVE_SENDFILE
+	size_t read_size;
+	ssize_t bytes_read;
+#endif
 
-	/* we assume that we're seeked to the position of the next byte that
-	 * needs to be written out to the client, so get seek position to
-	 * determine how many bytes we have left to read */
-	bytes_remaining = con->file_size - seek_pos;
+	/* file_offset is the next byte that needs to be written out to the
+	 * client, so use it to determine how many bytes we have left */
+	bytes_remaining = con->file_size - con->file_offset;
 
 	/* if none remaining, bail out, returning 0 indicating we're done */
-	if(bytes_remaining == 0) {
+	if(bytes_remaining <= 0) {
 		return 0; /* done writing file */
 	}
 
+	/* with io threads, only send what we know is in the page cache, so
+	 * that we never wait on the disk here. if we don't know that the next
+	 * part of the file is, have an io thread read it in, and carry on
+	 * once it has */
+	if(io_pool_enabled()) {
+		if(!file_data_ready(con)) {
+			if(bytes_remaining > RESIDENCY_PROBE_WINDOW) {
+				bytes_remaining = RESIDENCY_PROBE_WINDOW;
+			}
+			if(submit_warm_job(con, bytes_remaining)) {
+				return 1; /* still data to write, once read */
+			}
+		} else {
+			bytes_remaining = con->file_warmed_end
+				- con->file_offset;
+		}
+	}
+
+#ifdef HAVE_SENDFILE
+	/* let the kernel send as much as the socket buffer will take. it
+	 * advances file_offset by the number of bytes sent */
+	bytes_written = sendfile(con->fd, con->file_fd, &con->file_offset,
+			bytes_remaining);
+#else
 	/* determine our read size. read size is the smaller of the determined
-	 * optimal read size, or the bytes remaining. */
-	if(bytes_remaining < con->file_read_size) {
+	 * optimal read size (capped at our buffer size), or the bytes
+	 * remaining. */
+	read_size = con->file_read_size;
+	if(read_size > IO_BUF_SIZE) {
+		read_size = IO_BUF_SIZE;
+	}
+	if(bytes_remaining < (off_t)read_size) {
 		read_size = bytes_remaining;
-	} else {
-		read_size = con->file_read_size;
 	}
 
-	/* read that many bytes into the start of the buffer */
-	bytes_read = fread(con->file_read_buf, sizeof(char), read_size,
-			con->file_being_sent);
-
-	/* in weird scenarios, we might get end of file or an error before we
-	 * expect to be finished. handle these by just stopping the file
-	 * transfer - we can't tell the client something went wrong, because
-	 * we've already sent the http headers. */
-	if(feof(con->file_being_sent)) {
+	/* read that many bytes into the start of the buffer. in weird
+	 * scenarios, we might get end of file or an error before we expect
+	 * to be finished. handle these by just stopping the file transfer -
+	 * we can't tell the client something went wrong, because we've
+	 * already sent the http headers. */
+	bytes_read = pread(con->file_fd, con->file_read_buf, read_size,
+			con->file_offset);
+	if(bytes_read <= 0) {
+		con->keep_alive = 0;
 		return 0; /* indicate no more writing to do */
 	}
 
-	if(ferror(con->file_being_sent)) {
-		return 0; /* indicate no more writing */
-	}
-
 	/* write as many of those bytes out into the socket */
 	bytes_written = write(con->fd, con->file_read_buf, bytes_read);
 
-	/* check for failed write that isn't telling us to try again */
-	if(bytes_written == -1 && errno != EAGAIN) {
-		return 0; /* just say we're done writing */
+	if(bytes_written > 0) {
+		con->file_offset += bytes_written;
 	}
-
-	/* if we wrote less than we read, seek back */
-	seek_back = bytes_written - bytes_read;
-	if(seek_back < 0) {
-		if(fseek(con->file_being_sent, seek_back, SEEK_CUR) == -1) {
-			/* file seek failed. too late to tell the client,
-			 * because headers are already sent, so just say
-			 * that we're done writing */
+#endif
+
+	/* check for failed write - if it's telling us to try again, there's
+	 * still data left, otherwise just say we're done writing. the client
+	 * hasn't had the whole body, so the connection can't be reused */
+	if(bytes_written == -1) {
+		if(errno != EAGAIN) {
+			con->keep_alive = 0;
 			return 0;
 		}
+		loop_event_blocked(&con->ev_write);
+		return 1;
+	}
+
+	/* a 0 byte send means the file shrank under us, so give up */
+	if(bytes_written == 0) {
+		con->keep_alive = 0;
+		return 0;
+	}
+
+	__atomic_fetch_add(&stats->bytes_sent, bytes_written,
+			__ATOMIC_RELAXED);
+
+	/* return 1 if bytes left to write */
+	return con->file_offset < con->file_size;
+}
+
+/* reads the start of the file body into body_buf. this is best effort - if
+ * the malloc or read fails, or comes up short, whatever we didn't get is
+ * streamed from the file as usual once the in-memory bytes are written */
+void read_inline_body(struct client_connection *con) {
+
+	ssize_t bytes_read;
+
+	/* nothing to do for empty files */
+	if(con->file_size == 0) {
+		return;
+	}
+
+	con->body_buf = pool_alloc(&io_buf_pool);
+	if(con->body_buf == NULL) {
+		return;
 	}
+	con->body = con->body_buf;
+
+	/* read until we have the whole body, or the read stops giving us
+	 * data (short file, or error) */
+	while(con->body_length < (size_t)con->file_size) {
+		bytes_read = pread(con->file_fd,
+				con->body_buf + con->body_length,
+				con->file_size - con->body_length,
+				con->body_length);
+
+		if(bytes_read <= 0) {
+			break;
+		}
 
-	/* determine if we're done writing */
-	bytes_remaining = bytes_remaining - bytes_written;
-	return bytes_remaining != 0; /* return 1 if bytes left to write */
+		con->body_length += bytes_read;
+	}
 }
 
-/* writes all headers to the socket - returns 1 iff there's still headers that
- * need to be written (in future calls). returns -1 on failure. */
+/* writes the remaining headers (our own, then any prebuilt file headers), and
+ * any remaining in-memory body bytes, to the socket in a single writev(). the
+ * bytes written are accounted against the headers first, then the body.
+ * returns 1 iff there's still headers or in-memory body bytes that need to be
+ * written (in future calls). returns -1 on failure. */
 int write_headers_to_sock(struct client_connection* con) {
 
-	int bytes_remaining, bytes_written;
+	struct iovec iov[3];
+	struct msghdr msg;
+	int iovcnt = 0, flags = 0, file_headers_written;
+	ssize_t bytes_written;
+	size_t header_bytes_remaining, body_bytes_remaining = 0;
+
+	/* calculate how many header bytes left to write */
+	header_bytes_remaining = con->resp_headers_length
+		+ con->file_headers_length - con->resp_headers_written;
+
+	/* the header parts resume from where the last write left off */
+	if(con->resp_headers_written < con->resp_headers_length) {
+		iov[iovcnt].iov_base = con->resp_headers
+			+ con->resp_headers_written;
+		iov[iovcnt].iov_len = con->resp_headers_length
+			- con->resp_headers_written;
+		iovcnt++;
+	}
+
+	if(header_bytes_remaining > 0 && con->file_headers_length > 0) {
+		file_headers_written = con->resp_headers_written
+			- con->resp_headers_length;
+		if(file_headers_written < 0) {
+			file_headers_written = 0;
+		}
+
+		iov[iovcnt].iov_base = (char*)con->file_headers
+			+ file_headers_written;
+		iov[iovcnt].iov_len = con->file_headers_length
+			- file_headers_written;
+		iovcnt++;
+	}
 
-	/* calculate how many bytes left to write */
-	bytes_remaining = con->resp_headers_length - con->resp_headers_written;
+	/* followed by any in-memory body bytes not yet written */
+	if(con->file_offset < (off_t)con->body_length) {
+		body_bytes_remaining = con->body_length - con->file_offset;
+		iov[iovcnt].iov_base = (char*)con->body + con->file_offset;
+		iov[iovcnt].iov_len = body_bytes_remaining;
+		iovcnt++;
+	}
 
 	/* if 0 bytes remaining, return 0 indicating we're done */
-	if(bytes_remaining == 0) {
+	if(iovcnt == 0) {
 		return 0;
 	}
-	
-	/* write as many as we can */
-	bytes_written =
-		write(con->fd, con->resp_headers, bytes_remaining);
 
-	/* check for failed write that isn't telling us to retry */
-	if(bytes_written == -1 && errno != EAGAIN) {
-		return -1; /* indicate failure */
+#ifdef MSG_MORE
+	/* if more body follows from the file, or another pipelined response
+	 * follows straight after this one, tell the kernel so that they get
+	 * coalesced with this write into full segments. only if they're
+	 * ready to go now though - if they have to wait on an io thread,
+	 * these bytes would sit corked in the meantime */
+	if(con->status == SENDING_RESPONSE_FILE
+			&& con->method == HTTP_GET
+			&& con->body_length < (size_t)con->file_size
+			&& (!io_pool_enabled() || file_data_ready(con))) {
+		flags = MSG_MORE;
+	}
+
+	if(con->keep_alive && con->pipeline_count > 0
+			&& next_response_ready(con)) {
+		flags = MSG_MORE;
+	}
+#endif
+
+	/* write as many as we can. sendmsg() is writev() with flags */
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	bytes_written = sendmsg(con->fd, &msg, flags);
+
+	/* check for failed write - retry later if it's telling us to */
+	if(bytes_written == -1) {
+		if(errno != EAGAIN) {
+			return -1;
+		}
+		loop_event_blocked(&con->ev_write);
+		return 1;
 	}
 
-	/* update bytes written so far */
-	con->resp_headers_written += bytes_written;
+	__atomic_fetch_add(&stats->bytes_sent, bytes_written,
+			__ATOMIC_RELAXED);
 
-	/* recalc remaining bytes */
-	bytes_remaining = con->resp_headers_length - con->resp_headers_written;
+	/* account for the written bytes, headers first */
+	if((size_t)bytes_written <= header_bytes_remaining) {
+		con->resp_headers_written += bytes_written;
+	} else {
+		con->resp_headers_written += header_bytes_remaining;
+		con->file_offset += bytes_written - header_bytes_remaining;
+	}
 
 	/* return 1 iff there's still bytes remaining */
-	return bytes_remaining != 0;
+	return (size_t)bytes_written
+		!= header_bytes_remaining + body_bytes_remaining;
 }
 
 /* write headers common to both success and failure responses,
@@ -385,23 +1025,27 @@ int write_headers_to_sock(struct client_connection* con) {
 int write_common_headers(struct client_connection *con) {
 	
 	int off = 0; /* bytes written offset */
+	struct date_clock *clock;
 
 	/* write status line with response code */
 	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
-		       	"HTTP/1.0 %d \r\n",
+		       	"HTTP/1.1 %d \r\n",
 			con->resp_code);
 
-	/* get GMT time and write date header */
+	/* write date header, copying the date that the loop clock has
+	 * already formatted for this second */
 	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
 		       	"Date: ");
-	off += write_rfc1123_date(con->resp_headers + off, time(NULL),
-		RESPONSE_BUF_SIZE - off);
+	clock = loop_clock();
+	memcpy(con->resp_headers + off, clock->date, clock->date_length);
+	off += clock->date_length;
 
 	/* date format function doesn't include \r\n, write those */
 	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
 			"\r\nServer: fsmhttp\r\n");
 	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
-			"Connection: close\r\n");
+			"Connection: %s\r\n",
+			con->keep_alive ? "keep-alive" : "close");
 
 	return off;
 }
@@ -414,12 +1058,29 @@ void build_error_headers(struct client_connection *con) {
 	/* write common headers */
 	off = write_common_headers(con);
 
-	/* terminate headers with additional carriage return & newline,
-	 * to indicate that we've finished the headers. we don't write any
-	 * additional (body) data for error responses, because it's not
-	 * necessary to meet the spec */
-	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
-		       	"\r\n");
+	/* a not modified response has no body by definition, and describes
+	 * the version of the file the client has. we don't write any
+	 * additional (body) data for error responses either, because it's
+	 * not necessary to meet the spec. say so explicitly, so that the
+	 * client knows where the response ends on a kept-alive connection,
+	 * then terminate headers with additional carriage return & newline,
+	 * to indicate that we've finished the headers */
+	if(con->resp_code == RESPONSE_CODE_NOT_MODIFIED) {
+		off += snprintf(con->resp_headers + off,
+				RESPONSE_BUF_SIZE - off, "Last-Modified: ");
+		off += write_rfc1123_date(con->resp_headers + off,
+				con->file_last_modified,
+				RESPONSE_BUF_SIZE - off);
+		off += snprintf(con->resp_headers + off,
+				RESPONSE_BUF_SIZE - off, "\r\nETag: ");
+		off += file_etag(con, con->resp_headers + off);
+		off += snprintf(con->resp_headers + off,
+				RESPONSE_BUF_SIZE - off, "\r\n\r\n");
+	} else {
+		off += snprintf(con->resp_headers + off,
+				RESPONSE_BUF_SIZE - off,
+				"Content-Length: 0\r\n\r\n");
+	}
 
 	/* store headers length now that we're done */
 	con->resp_headers_length = off;
@@ -434,6 +1095,15 @@ void build_file_headers(struct client_connection *con) {
 	 * we've written so far */
 	off = write_common_headers(con);
 
+	/* if the file is cached, the rest of the headers are prebuilt, and
+	 * we write them straight from the cache */
+	if(con->file_entry != NULL) {
+		con->file_headers = con->file_entry->headers;
+		con->file_headers_length = con->file_entry->headers_length;
+		con->resp_headers_length = off;
+		return;
+	}
+
 	/* get length of file and write content length header */
 	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
 		       	"Content-Length: %ld\r\n",
@@ -445,6 +1115,11 @@ void build_file_headers(struct client_connection *con) {
 	off += write_rfc1123_date(con->resp_headers + off,
 			con->file_last_modified, RESPONSE_BUF_SIZE - off);
 
+	/* and the entity tag */
+	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
+			"\r\nETag: ");
+	off += file_etag(con, con->resp_headers + off);
+
 	/* terminate headers with additional carriage return & newline */
 	off += snprintf(con->resp_headers + off, RESPONSE_BUF_SIZE - off,
 			"\r\n\r\n");
@@ -457,48 +1132,154 @@ void build_file_headers(struct client_connection *con) {
 
 void event_handler_accept(int fd, short event, void *arg) {
 
-	struct client_connection *con;
+	struct accepted_connection accepted;
+	struct event_loop *idlest;
 	socklen_t addrlen;
+	long long now;
+	int i, shedding;
 
-	/* allocate storage for connection, zero'd out */
-	con = calloc(1, sizeof(struct client_connection));
+	now = timer_now();
+	shedding = queue_overloaded(now);
 
-	if(con == NULL) {
-		/* if there's a malloc failure here, we can't even store
-		 * enough state to keep track of the connection, but be nice
-		 * and assume this malloc failure is transient (we might get
-		 * more memory later?) */
-		return;
+	/* accept a batch of connections. with several loops, the epoll
+	 * engine wakes just one of them for each, but under libevent they all
+	 * get woken, and the ones that lose the race get EAGAIN */
+	for(i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+
+		/* make sure we can keep track of a connection before taking
+		 * it off the backlog */
+		if(!reserve_connection()) {
+			pause_accepting();
+			return;
+		}
+
+		addrlen = sizeof(struct sockaddr_storage);
+#ifdef HAVE_ACCEPT4
+		accepted.fd = accept4(fd,
+				(struct sockaddr*)&accepted.client_addr,
+				&addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+		accepted.fd = accept(fd,
+				(struct sockaddr*)&accepted.client_addr,
+				&addrlen);
+#endif
+
+		if(accepted.fd == -1) {
+			if(errno == EAGAIN) {
+				loop_event_blocked(&this_loop->accept_event);
+				return; /* backlog is empty */
+			}
+			if(errno == ECONNABORTED || errno == EINTR) {
+				continue; /* lost that one, try the next */
+			}
+
+			/* out of fds or kernel memory. the connection
+			 * stays in the backlog, and we'd only be woken
+			 * straight back up for it, so stop for a bit */
+			pause_accepting();
+			return;
+		}
+
+#ifndef HAVE_ACCEPT4
+		set_flags_non_block(accepted.fd);
+#endif
+
+		accepted.accepted_at = now;
+
+		__atomic_fetch_add(&stats->connections, 1, __ATOMIC_RELAXED);
+
+		/* if work is already waiting too long on this loop, turn the
+		 * connection away before it adds to the wait */
+		if(shedding) {
+			shed_connection(accepted.fd);
+			continue;
+		}
+
+		/* count the connection against the budget, and turn it away
+		 * if we're over */
+		if(__atomic_add_fetch(&open_connections, 1, __ATOMIC_RELAXED)
+				> max_connections) {
+			__atomic_fetch_sub(&open_connections, 1,
+					__ATOMIC_RELAXED);
+			shed_connection(accepted.fd);
+			continue;
+		}
+
+		/* if we're much busier than the least loaded loop, queue the
+		 * connection for it to steal rather than starting it here */
+		if(num_loops > 1) {
+			idlest = least_loaded_loop();
+
+			if(loop_load(this_loop)
+					>= loop_load(idlest) + STEAL_THRESHOLD
+					&& conn_queue_push(&this_loop->queue,
+						&accepted)) {
+				wake_loop(idlest);
+				continue;
+			}
+		}
+
+		start_connection(&accepted);
+	}
+}
+
+/* makes sure there's state allocated for the next connection we start.
+ * returns 1 iff there is */
+int reserve_connection(void) {
+
+	if(spare_connection != NULL) {
+		return 1;
+	}
+
+	/* allocate storage for connection, zero'd out */
+	spare_connection = pool_calloc(&connection_pool);
+	if(spare_connection == NULL) {
+		return 0;
 	}
 
 	/* allocate storage for request buffer */
-	con->request_buf_size = REQUEST_HEADER_BUF_START_SIZE;
-	con->request_buf = malloc(con->request_buf_size
-			* sizeof(char));
-	
-	/* same deal as above - just bail out on malloc failure and pray to
-	 * the malloc gods for more later */
-	if(con->request_buf == NULL) {
-		free(con); /* too early to log anything, so just clean up */
-		return;
+	spare_connection->request_buf = pool_alloc(&request_buf_pool);
+	if(spare_connection->request_buf == NULL) {
+		pool_free(&connection_pool, spare_connection);
+		spare_connection = NULL;
+		return 0;
 	}
-	
-	/* accept the incoming connection */
-	addrlen = sizeof(struct sockaddr_storage);
-	con->fd = accept(fd, (struct sockaddr*)&con->client_addr, &addrlen);
 
-	if(con->fd == -1) {
-		free(con); /* not a valid connection, so free allocation */
+	return 1;
+}
+
+/* sets up state for an accepted connection on this loop, and starts waiting
+ * for its request */
+void start_connection(struct accepted_connection *accepted) {
+
+	struct client_connection *con;
+
+	/* if there's a malloc failure here, we can't even store enough state
+	 * to keep track of the connection, so drop it and assume this malloc
+	 * failure is transient (we might get more memory later?). callers
+	 * reserve first where they can, so this is rare */
+	if(!reserve_connection()) {
+		close_connection_socket(accepted->fd);
 		return;
 	}
 
-	/* set fd to non blocking */
-	set_flags_non_block(con->fd);
+	con = spare_connection;
+	spare_connection = NULL;
+
+	con->request_buf_size = REQUEST_HEADER_BUF_START_SIZE;
+	con->fd = accepted->fd;
+	wheel_timer_init(&con->timeout, connection_timed_out, con);
+	con->client_addr = accepted->client_addr;
+
+	/* no file opened yet */
+	con->file_fd = -1;
 
-	/* setup event for when socket is ready for reading. we'll
-	 * setup the write event once we've parsed a valid request */
-	event_set(&con->ev_read, con->fd, EV_READ|EV_PERSIST,
+	/* setup events for when socket is ready for reading and writing.
+	 * we'll only add the write event once we've parsed a valid request */
+	loop_event_set(&con->ev_read, con->fd, EV_READ|EV_PERSIST,
 			event_handler_read, con);
+	loop_event_set(&con->ev_write, con->fd, EV_WRITE|EV_PERSIST,
+			event_handler_write, con);
 
 	/* initialise http parser for this connection */
 	http_parser_init(&con->parser, HTTP_REQUEST);
@@ -507,24 +1288,49 @@ void event_handler_accept(int fd, short event, void *arg) {
 	 * the state in parser callbacks */
 	con->parser.data = con;
 
-	/* setup http parser settings, on_url and on_headers callbacks */
+	/* setup http parser settings, on_url, on_headers and on_message
+	 * callbacks */
 	http_parser_settings_init(&con->parser_settings);
 	con->parser_settings.on_url = on_url_parsed;
+	con->parser_settings.on_header_field = on_header_field;
+	con->parser_settings.on_header_value = on_header_value;
 	con->parser_settings.on_headers_complete = on_headers_complete;
+	con->parser_settings.on_message_complete = on_message_complete;
 
 	/* set current state of connection to indicate we haven't got
 	 * complete request headers yet */
 	con->status = NEW_CONNECTION_HEADERS_INCOMPLETE;
 
-	/* register read event now that we're ready */
-	event_add(&con->ev_read, NULL); /* add with no timeout */
+	/* the connection is ours now */
+	__atomic_store_n(&this_loop->active_connections,
+			this_loop->active_connections + 1, __ATOMIC_RELAXED);
+
+	/* register read event now that we're ready, and give the client
+	 * so long to send its request */
+	loop_event_add(&con->ev_read, NULL); /* add with no timeout */
+	set_timeout(con, header_timeout);
+
+	/* the request has often arrived by the time we accept (always, with
+	 * deferred accepts), so try reading it now rather than waiting a
+	 * loop iteration to be told it's there */
+	event_handler_read(con->fd, EV_READ, con);
+}
+
+/* starts a connection taken from a steal queue. how long it sat there counts
+ * towards the loop's queueing delay */
+void start_queued_connection(struct accepted_connection *accepted) {
+
+	long long now = timer_now();
+
+	record_queue_delay(now - accepted->accepted_at, now);
+	start_connection(accepted);
 }
 
 void event_handler_read(int fd, short event, void *arg) {
 
 	struct client_connection *con;
-	int this_read_bytes, bytes_remaining_in_buf, bytes_parsed;
-	char *current_buf_position;
+	int this_read_bytes, bytes_remaining_in_buf;
+	char *current_buf_position, *new_request_buf;
 
 	con = arg; /* get connection state */
 
@@ -532,20 +1338,40 @@ void event_handler_read(int fd, short event, void *arg) {
 	bytes_remaining_in_buf = con->request_buf_size
 		- con->request_buf_bytes_read;
 
-	/* if no room for additional bytes, double buffer */
+	/* if no room for additional bytes, double buffer. we only keep
+	 * offsets into the buffer, so it's fine for realloc to move it. the
+	 * starting size buffer belongs to the pool, so copy out of that one
+	 * rather than realloc it */
 	if(bytes_remaining_in_buf == 0) {
-		con->request_buf_size *= 2; /* double size */
-		con->request_buf = realloc(con->request_buf,
-				sizeof(char) * con->request_buf_size);
+		if(con->request_buf_size == REQUEST_HEADER_BUF_START_SIZE) {
+			new_request_buf = malloc(sizeof(char)
+					* con->request_buf_size * 2);
+			if(new_request_buf != NULL) {
+				memcpy(new_request_buf, con->request_buf,
+						con->request_buf_size);
+				pool_free(&request_buf_pool,
+						con->request_buf);
+			}
+		} else {
+			new_request_buf = realloc(con->request_buf,
+					sizeof(char) * con->request_buf_size
+					* 2);
+		}
 
-		if(con->request_buf == NULL) {
+		if(new_request_buf == NULL) {
 			/* malloc failed for the request buffer, but on the
 			 * off chance that the failure is transient, try to
 			 * reply with an internal server error */
 			prepare_error_code_response(con,
 					RESPONSE_CODE_INTERNAL_SERVER_ERROR);
+			start_response(con);
 			return;
 		}
+
+		con->request_buf = new_request_buf;
+		con->request_buf_size *= 2; /* double size */
+		bytes_remaining_in_buf = con->request_buf_size
+			- con->request_buf_bytes_read;
 	}
 
 	/* get current position in buffer considering bytes already read */
@@ -555,39 +1381,203 @@ void event_handler_read(int fd, short event, void *arg) {
 	this_read_bytes = read(con->fd, current_buf_position,
 			bytes_remaining_in_buf);
 
-	/* if we get an error read, that isn't telling us to try again, try to
-	 * end the connection gracefully, and to be nice we'll try to write
-	 * an error response */
-	if(this_read_bytes == -1 && errno != EAGAIN) {
-		prepare_error_code_response(con,
-				RESPONSE_CODE_INTERNAL_SERVER_ERROR);
+	/* if we're told to try again, wait for the next read event */
+	if(this_read_bytes == -1 && errno == EAGAIN) {
+		loop_event_blocked(&con->ev_read);
 		return;
 	}
 
-	/* if we get a 0 byte read, the other side has closed the connection,
-	 * so write how this connection went on the access log, then
-	 * clean up this connection, including all sockets, open files
-	 * and memory allocations */
-	if(this_read_bytes == 0) {
+	/* if we get an error read, the connection is broken, and if we get a
+	 * 0 byte read, the other side has closed the connection. either way
+	 * write how this connection went on the access log, then clean up
+	 * this connection, including all sockets, open files and memory
+	 * allocations */
+	if(this_read_bytes <= 0) {
 		end_connection(con);
 		return;
 	}
 
+	/* the next request on a kept-alive connection has started to arrive,
+	 * so it now has so long to finish */
+	if(con->request_buf_bytes_read == 0 && con->requests_served > 0) {
+		set_timeout(con, header_timeout);
+	}
+
 	/* store bytes read so far */
 	con->request_buf_bytes_read += this_read_bytes;
 
-	/* fire parser for bytes read so far. if we get headers complete,
-	 * we'll update the state for the connection and setup a write
-	 * event so that we can provide our response. otherwise we'll
-	 * wait for more data so that eventually we get complete headers */
-	bytes_parsed = http_parser_execute(&con->parser, &con->parser_settings,
-			con->request_buf, con->request_buf_bytes_read);
+	parse_request_buf(con);
 
-	if(bytes_parsed != con->request_buf_bytes_read) {
-		/* parse failed - return bad request */
-		prepare_error_code_response(con, RESPONSE_CODE_BAD_REQ);
-		return;
+	write_now(con);
+}
+
+/* fire parser for bytes read since it last ran - the parser keeps its state
+ * between calls, so each byte is only parsed once. each complete request is
+ * queued on the pipeline, and we keep parsing until we run out of bytes, the
+ * pipeline is full, or we queue a request after which the connection won't
+ * be kept. if there's no response in progress and we've queued a request,
+ * we'll start writing its response. otherwise we'll wait for more data so
+ * that eventually we get complete requests */
+void parse_request_buf(struct client_connection *con) {
+
+	int bytes_parsed, bytes_unfed;
+
+	while(con->pipeline_count < PIPELINE_MAX_DEPTH
+			&& !con->pipeline_closed) {
+
+		bytes_unfed = con->request_buf_bytes_read - con->request_fed;
+
+		if(bytes_unfed == 0) {
+			break;
+		}
+
+		bytes_parsed = http_parser_execute(&con->parser,
+				&con->parser_settings,
+				con->request_buf + con->request_fed,
+				bytes_unfed);
+		con->request_fed += bytes_parsed;
+
+		/* if the parser paused, it's reached the end of a request
+		 * and queued it, so start the parser afresh and go round
+		 * for the next one */
+		if(HTTP_PARSER_ERRNO(&con->parser) == HPE_PAUSED) {
+			con->request_parsed = con->request_fed;
+			http_parser_init(&con->parser, HTTP_REQUEST);
+			con->parser.data = con;
+			continue;
+		}
+
+		/* parse failed - queue a bad request response */
+		if(bytes_parsed != bytes_unfed) {
+			queue_request(con, 0, RESPONSE_CODE_BAD_REQ);
+		}
+
+		/* otherwise the request is incomplete */
+		break;
+	}
+
+	/* respond to the first queued request, unless we're already busy
+	 * responding to an earlier one */
+	if(con->status == NEW_CONNECTION_HEADERS_INCOMPLETE
+			&& con->pipeline_count > 0) {
+		start_next_response(con);
+	}
+}
+
+/* adds the request the parser has just finished with to the end of the
+ * pipeline. the url has already been stored in its slot by on_url_parsed */
+void queue_request(struct client_connection *con, int keep_alive,
+		enum response_code error_code) {
+
+	struct queued_request *req;
+
+	req = &con->pipeline[(con->pipeline_head + con->pipeline_count)
+		% PIPELINE_MAX_DEPTH];
+
+	req->method = con->parser.method;
+	req->keep_alive = keep_alive;
+	req->error_code = error_code;
+
+	con->pipeline_count++;
+
+	/* no point parsing anything after a request we'll close after */
+	if(!keep_alive) {
+		con->pipeline_closed = 1;
+	}
+}
+
+/* takes the request at the front of the pipeline, decides whether there's a
+ * file to respond with, or whether we need to return an error code response,
+ * then starts writing the response */
+void start_next_response(struct client_connection *con) {
+
+	struct queued_request *req;
+
+	req = &con->pipeline[con->pipeline_head];
+	con->pipeline_head = (con->pipeline_head + 1) % PIPELINE_MAX_DEPTH;
+	con->pipeline_count--;
+
+	con->method = req->method;
+	con->url_offset = req->url_offset;
+	con->url_length = req->url_length;
+	con->if_modified_since = req->if_modified_since;
+	con->if_none_match_offset = req->if_none_match_offset;
+	con->if_none_match_length = req->if_none_match_length;
+
+	/* the slot is free for the parser again, and it expects no url or
+	 * headers */
+	req->url_length = 0;
+	req->if_modified_since = 0;
+	req->if_none_match_length = 0;
+
+	/* only keep the connection open after this response if the client
+	 * wants that, and it hasn't used up its request allowance */
+	con->keep_alive = req->keep_alive
+		&& con->requests_served + 1 < max_keepalive_requests;
+
+	/* set state to indicate headers complete */
+	con->status = HEADERS_COMPLETE;
+
+	/* if the request couldn't be parsed, or method is not GET or HEAD,
+	 * fail. otherwise process the request using the URL that we've
+	 * stored, and transition the connection status to one of the
+	 * SENDING_ response states */
+	if(req->error_code != RESPONSE_CODE_UNINITIALISED) {
+		prepare_error_code_response(con, req->error_code);
+	} else {
+		switch(con->method) {
+			case HTTP_GET:
+			case HTTP_HEAD:
+				process_request(con);
+				break;
+			default:
+				prepare_error_code_response(con,
+					RESPONSE_CODE_METHOD_NOT_ALLOWED);
+		}
+	}
+
+	/* now that we've processed the request and know how we're
+	 * responding, start sending the response */
+	start_response(con);
+}
+
+/* 1 iff the next pipelined response can be written as soon as this one is
+ * done, rather than having to wait on an io thread first. it follows the
+ * same choice process_request() makes, but only looks at the file cache */
+int next_response_ready(struct client_connection *con) {
+
+	struct queued_request *req;
+	const struct file_cache_entry *entry;
+	char req_path[PATH_MAX];
+	size_t req_path_len;
+	int stale;
+
+	if(!io_pool_enabled()) {
+		return 1;
 	}
+
+	req = &con->pipeline[con->pipeline_head];
+
+	/* errors are answered straight away */
+	if(req->error_code != RESPONSE_CODE_UNINITIALISED
+			|| (req->method != HTTP_GET
+				&& req->method != HTTP_HEAD)
+			|| request_path(con->request_buf + req->url_offset,
+				req->url_length, req_path, &req_path_len)
+			!= RESPONSE_CODE_UNINITIALISED) {
+		return 1;
+	}
+
+	entry = file_cache_peek(req_path, req_path_len, loop_clock()->time,
+			&stale);
+
+	/* a small body that isn't loaded yet may not be needed, if the
+	 * request is conditional. we don't know without checking, so say
+	 * it isn't ready */
+	return entry != NULL && !stale
+		&& (req->method != HTTP_GET || entry->body != NULL
+				|| entry->size == 0
+				|| entry->size > FILE_CACHE_MAX_BODY_SIZE);
 }
 
 void event_handler_write(int fd, short event, void *arg) {
@@ -595,118 +1585,1015 @@ void event_handler_write(int fd, short event, void *arg) {
 	 * with an error code, or sending a file. so this should only be
 	 * called if we're in one of these two states:
 	 * SENDING_ERROR_RESPONSE_CODE, 
-	 * SENDING_RESPONSE_FILE */
+	 * SENDING_RESPONSE_FILE
+	 *
+	 * once a response is done, the next pipelined response may start
+	 * straight away, so we keep writing while we're in one of them */
 	
 	struct client_connection *con;
 	int header_write_result;
 
 	con = arg; /* get connection state */
 
-	/* Write events should only be setup if we've got a valid request,
-	 * so in all instances we need to build headers for a response.
-	 * Depending on the response type (as determined by the state),
-	 * build the headers if they're not already built */
-	if(con->resp_headers == NULL) {
-
-		/* malloc space for response headers */
-		con->resp_headers = malloc(sizeof(char) * RESPONSE_BUF_SIZE);
+	/* the client is taking what we've sent, so give it longer */
+	set_timeout(con, send_timeout);
+
+	while(con->status == SENDING_ERROR_RESPONSE_CODE
+			|| con->status == SENDING_RESPONSE_FILE) {
+
+		/* Depending on the response type (as determined by the
+		 * state), build the headers if they're not already built.
+		 * the header buffer is kept for later responses on a
+		 * kept-alive connection */
+		if(con->resp_headers_length == 0) {
+
+			/* malloc space for response headers */
+			if(con->resp_headers == NULL) {
+				con->resp_headers =
+					pool_alloc(&resp_headers_pool);
+			}
+
+			/* if we can't malloc space for a response, just
+			 * shutdown the connection gracefully */
+			if(con->resp_headers == NULL) {
+				clean_shutdown(con);
+				return;
+			}
+
+			/* otherwise build the headers for the response */
+			if(con->status == SENDING_ERROR_RESPONSE_CODE) {
+				build_error_headers(con);
+			} else {
+				build_file_headers(con);
+			}
+		}
 
-		/* if we can't malloc space for a response, just shutdown the
-		 * connection gracefully */
-		if(con->resp_headers == NULL) {
-			clean_shutdown(con);
+		/* try to write headers, along with the body if it's held in
+		 * memory - returns 1 iff there's still data left to write,
+		 * or -1 if there's an error */
+		header_write_result = write_headers_to_sock(con);
+		if(header_write_result == 1) {
+			return; /* we'll write more on the next event fire */
+		} else if (header_write_result == -1) {
+			clean_shutdown(con); /* failed to write headers */
 			return;
 		}
 
-		/* otherwise build the headers for the response */
-		switch(con->status) {
-			case SENDING_ERROR_RESPONSE_CODE:
-				build_error_headers(con);
-				break;
-			case SENDING_RESPONSE_FILE:
-				build_file_headers(con);
-				break;
-			default: return; /* should not happen */
+		/* If we're sending a file, try to send whatever part of it
+		 * wasn't held in memory now, and if there's still data to
+		 * write, stop.
+		 *
+		 * Note that we only send a file for GET requests, for HEAD
+		 * requests we don't send the body. */
+		if(con->status == SENDING_RESPONSE_FILE
+				&& con->method == HTTP_GET) {
+			if(write_file_to_sock(con)) {
+				return; /* still data to write */
+			}
+		}
+
+		/* By this point the headers have been written, and if we're
+		 * sending a file body, we've finished sending that too. if
+		 * that's the end of the connection, it's gone */
+		if(!finish_response(con)) {
+			return;
 		}
 	}
+}
 
-	/* try to write headers - returns 1 iff headers left to write, or
-	 * -1 if there's an error */
-	header_write_result = write_headers_to_sock(con);
-	if(header_write_result == 1) {
-		return; /* we'll write more on the next event fire */
-	} else if (header_write_result == -1) {
-		clean_shutdown(con); /* failed to write headers */
+/* ---------- response lifecycle ---------- */
+
+/* once we know how we're responding to a request, stop reading from the
+ * client and wait until we can write the response. any further requests
+ * the client sends stay in the socket until the pipeline is drained */
+void start_response(struct client_connection *con) {
+
+	loop_event_del(&con->ev_read);
+
+	/* while the io threads are working on the request, there's nothing
+	 * to write yet. we'll start again when they're done, and they hold
+	 * the connection until then, so it mustn't time out */
+	if(con->status == WAITING_FOR_FILE_IO) {
+		loop_event_del(&con->ev_write);
+		wheel_timer_cancel(&con->timeout);
 		return;
 	}
 
-	/* If we're sending a file, try to send that now, and if there's
-	 * still data to write, stop (we perform socket shutdown below).
-	 *
-	 * Note that we only send a file for GET requests, for HEAD requests
-	 * we don't send the body. */
-	if(con->status == SENDING_RESPONSE_FILE
-			&& con->parser.method == HTTP_GET) {
-		if(write_file_to_sock(con)) {
-			return; /* still data to write */
+	set_timeout(con, send_timeout);
+
+	loop_event_add(&con->ev_write, NULL); /* add with no timeout */
+}
+
+/* once a response has started, try writing it straight away. the socket
+ * usually has room, so this saves a loop iteration waiting for the write
+ * event - which stays added in case we get EAGAIN */
+void write_now(struct client_connection *con) {
+
+	if(con->status == SENDING_ERROR_RESPONSE_CODE
+			|| con->status == SENDING_RESPONSE_FILE) {
+		event_handler_write(con->fd, EV_WRITE, con);
+	}
+}
+
+/* called once a response has been completely written. logs the request, then
+ * either moves the connection on to the next request, or shuts it down.
+ * returns 1 iff the connection is still open, otherwise it's been freed */
+int finish_response(struct client_connection *con) {
+
+	/* access log request if logging on */
+	if(access_log_file != NULL) {
+		log_connection(con);
+	}
+	con->logged = 1;
+
+	con->requests_served++;
+
+	__atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+	if(con->resp_code != RESPONSE_CODE_OK
+			&& con->resp_code != RESPONSE_CODE_NOT_MODIFIED) {
+		__atomic_fetch_add(&stats->error_responses, 1,
+				__ATOMIC_RELAXED);
+	}
+
+	/* we can only reuse the connection if the client asked for that, and
+	 * it hasn't used up its request allowance */
+	if(!con->keep_alive) {
+		clean_shutdown(con);
+		return 0;
+	}
+
+	reset_connection(con);
+	return 1;
+}
+
+/* reset the per-request connection state, then start on the next pipelined
+ * request, or if there isn't one, go back to NEW_CONNECTION_HEADERS_INCOMPLETE
+ * to wait for it. the request and header buffers are kept for reuse */
+void reset_connection(struct client_connection *con) {
+
+	int leftover_bytes;
+	struct queued_request *req;
+
+	/* close file if it was opened */
+	release_file(con);
+
+	/* free per-request buffers */
+	if(con->file_read_buf != NULL) {
+		pool_free(&io_buf_pool, con->file_read_buf);
+		con->file_read_buf = NULL;
+	}
+
+	if(con->body_buf != NULL) {
+		pool_free(&io_buf_pool, con->body_buf);
+		con->body_buf = NULL;
+	}
+	con->body = NULL;
+
+	/* clear per-request state */
+	con->url_offset = 0;
+	con->url_length = 0;
+	con->if_modified_since = 0;
+	con->if_none_match_length = 0;
+	con->resp_headers_written = 0;
+	con->resp_headers_length = 0;
+	con->file_headers = NULL;
+	con->file_headers_length = 0;
+	con->file_offset = 0;
+	con->file_warmed_end = 0;
+	con->file_size = 0;
+	con->file_read_size = 0;
+	con->file_last_modified = 0;
+	con->file_last_modified_nsec = 0;
+	con->file_ino = 0;
+	con->body_length = 0;
+	con->resp_code = RESPONSE_CODE_UNINITIALISED;
+	con->keep_alive = 0;
+	con->logged = 0;
+
+	con->status = NEW_CONNECTION_HEADERS_INCOMPLETE;
+
+	if(con->pipeline_count > 0) {
+		/* the next request is already parsed, so respond to it */
+		start_next_response(con);
+	} else {
+		/* now that the pipeline is empty, move any bytes the client
+		 * sent after the parsed requests to the start of the buffer,
+		 * shifting the offsets into it for the partly parsed request,
+		 * then parse whatever the parser hasn't seen yet */
+		leftover_bytes = con->request_buf_bytes_read
+			- con->request_parsed;
+		memmove(con->request_buf,
+				con->request_buf + con->request_parsed,
+				leftover_bytes);
+		con->request_buf_bytes_read = leftover_bytes;
+		con->request_fed -= con->request_parsed;
+
+		req = &con->pipeline[con->pipeline_head];
+		if(req->url_length > 0) {
+			req->url_offset -= con->request_parsed;
+		}
+		if(req->if_none_match_length > 0) {
+			req->if_none_match_offset -= con->request_parsed;
+		}
+		if(con->header_field_length > 0) {
+			con->header_field_offset -= con->request_parsed;
+		}
+		if(con->header_value_length > 0) {
+			con->header_value_offset -= con->request_parsed;
 		}
+
+		con->request_parsed = 0;
+
+		parse_request_buf(con);
 	}
 
-	/* By this point the headers have been written, and if we're sending
-	 * a file body, we've finished sending that too. */
-	clean_shutdown(con);
+	/* if there's no response ready to go, wait for the next request, but
+	 * only for so long - or for the rest of it, if it's partly here */
+	if(con->status == NEW_CONNECTION_HEADERS_INCOMPLETE) {
+		loop_event_del(&con->ev_write);
+		loop_event_add(&con->ev_read, NULL);
+		set_timeout(con, con->request_buf_bytes_read > 0
+				? header_timeout : keepalive_timeout);
+	}
 }
 
 /* ---------- connection cleanup ---------- */
 
 void clean_shutdown(struct client_connection* con) {
-	/* We'll now transition the connection into a shutdown state, we'll
-	 * shutdown our end of the socket, then wait for a read() to return 0
-	 * indicating EOF, which suggests the client has closed the
-	 * connection */
-	con->status = CLEAN_CONNECTION_SHUTDOWN;
-	shutdown(con->fd, SHUT_WR);
+	/* We'll now shutdown our end of the socket, then wait for a read() to
+	 * return 0 indicating EOF, which suggests the client has closed the
+	 * connection. everything but the socket is freed now, so waiting
+	 * costs next to nothing */
+
+	struct lingering_connection *linger;
+	int fd = con->fd;
+
+	shutdown(fd, SHUT_WR);
+	free_connection(con);
+
+	/* if we can't even keep track of the socket, just close it */
+	linger = pool_alloc(&linger_pool);
+	if(linger == NULL) {
+		close_connection_socket(fd);
+		return;
+	}
+
+	linger->fd = fd;
+	wheel_timer_init(&linger->timeout, linger_timed_out, linger);
+	loop_event_set(&linger->ev_read, fd, EV_READ|EV_PERSIST,
+			event_handler_linger_read, linger);
+
+	/* start reading again to wait for EOF, but not forever */
+	loop_event_add(&linger->ev_read, NULL); /* add with no timeout */
+	wheel_timer_add(&timeouts, &linger->timeout,
+			timeout_expiry(linger_timeout));
 }
 
-/* called once we get a 0 byte read indicating the client has gone away -
- * logs the connection to the access log, cleans up sockets, files and
- * memory allocations */
+/* called once we get a 0 byte read indicating the client has gone away, or
+ * the connection times out - cleans up sockets, files and memory
+ * allocations */
 void end_connection(struct client_connection* con) {
 
-	/* access log connection if logging on */
-	if(access_log_file != NULL) {
-		log_connection(access_log_file, con);
+	int fd = con->fd;
+
+	free_connection(con);
+
+	/* close connection socket */
+	close_connection_socket(fd);
+}
+
+/* frees everything for a connection but its socket, logging the connection
+ * to the access log if the current request hasn't been logged already */
+void free_connection(struct client_connection* con) {
+
+	struct accepted_connection accepted;
+
+	/* access log connection if logging on. a kept-alive connection that
+	 * goes away between requests has nothing left to log */
+	if(access_log_file != NULL && !con->logged
+			&& (con->requests_served == 0
+				|| con->request_buf_bytes_read > 0)) {
+		log_connection(con);
 	}
 
-	/* unregister events */
-	event_del(&con->ev_read);
-	event_del(&con->ev_write);
+	/* unregister events and timeout */
+	loop_event_del(&con->ev_read);
+	loop_event_del(&con->ev_write);
+	wheel_timer_cancel(&con->timeout);
 
-	/* free request buffer - this includes the URL */
+	/* free request buffer - this includes the URL. it only belongs to
+	 * the pool if it's never grown */
 	if(con->request_buf != NULL) {
-		free(con->request_buf);
+		if(con->request_buf_size == REQUEST_HEADER_BUF_START_SIZE) {
+			pool_free(&request_buf_pool, con->request_buf);
+		} else {
+			free(con->request_buf);
+		}
 	}
 
 	/* free response headers if they were created */
 	if(con->resp_headers != NULL) {
-		free(con->resp_headers);
+		pool_free(&resp_headers_pool, con->resp_headers);
 	}
 
 	/* close file if it was opened */
-	if(con->file_being_sent != NULL) {
-		fclose(con->file_being_sent);
-	}
+	release_file(con);
 
 	/* free file read buffer if it was used */
 	if(con->file_read_buf != NULL) {
-		free(con->file_read_buf);
+		pool_free(&io_buf_pool, con->file_read_buf);
 	}
 
-	/* close connection socket - we've already performed a write shutdown
-	 * and waited for the 0 byte read from the client, so client should
-	 * have received all data by now */
-	close(con->fd);
+	/* free in-memory body if it was read */
+	if(con->body_buf != NULL) {
+		pool_free(&io_buf_pool, con->body_buf);
+	}
 
 	/* free connection struct */
-	free(con);
+	pool_free(&connection_pool, con);
+
+	__atomic_store_n(&this_loop->active_connections,
+			this_loop->active_connections - 1, __ATOMIC_RELAXED);
+
+	/* now that we've got room, start a connection we queued earlier if
+	 * nobody has stolen it yet */
+	if(num_loops > 1 && reserve_connection()
+			&& conn_queue_pop(&this_loop->queue, &accepted)) {
+		start_queued_connection(&accepted);
+	}
+}
+
+/* a lingering connection's client has sent something. throw it away, and
+ * finish once the client closes */
+void event_handler_linger_read(int fd, short event, void *arg) {
+
+	struct lingering_connection *linger = arg;
+	char buf[4096];
+	ssize_t bytes_read;
+
+	bytes_read = read(fd, buf, sizeof(buf));
+
+	if(bytes_read == -1 && errno == EAGAIN) {
+		loop_event_blocked(&linger->ev_read);
+		return;
+	}
+
+	/* 0 bytes means the client has closed, and on an error it's gone */
+	if(bytes_read <= 0) {
+		end_linger(linger);
+	}
+}
+
+/* the client hasn't closed in time, so don't wait any longer */
+void linger_timed_out(struct wheel_timer *timer) {
+
+	end_linger(timer->arg);
+}
+
+void end_linger(struct lingering_connection *linger) {
+
+	loop_event_del(&linger->ev_read);
+	wheel_timer_cancel(&linger->timeout);
+	close_connection_socket(linger->fd);
+	pool_free(&linger_pool, linger);
+}
+
+/* ---------- admission control ---------- */
+
+/* the most connections we'll keep open: as many as we have fds for, less
+ * what the rest of the server needs, and no more than the command line
+ * allows, by count or by memory. we raise our fd limit as far as we can
+ * first */
+unsigned long connection_budget(struct cl_args *cl_args) {
+
+	struct rlimit limit;
+	unsigned long budget = ULONG_MAX, reserve, by_memory;
+
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		if(limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			if(setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+				getrlimit(RLIMIT_NOFILE, &limit);
+			}
+		}
+
+		if(limit.rlim_cur != RLIM_INFINITY) {
+			reserve = FD_RESERVE + (unsigned long)num_loops
+				* cl_args->file_cache_entries;
+			budget = limit.rlim_cur > reserve
+				? limit.rlim_cur - reserve : 1;
+		}
+	}
+
+	if(cl_args->max_connections > 0
+			&& (unsigned long)cl_args->max_connections < budget) {
+		budget = cl_args->max_connections;
+	}
+
+	/* a connection needs its state, request buffer and headers buffer */
+	if(cl_args->connection_kbytes > 0) {
+		by_memory = (unsigned long)cl_args->connection_kbytes * 1024
+			/ (sizeof(struct client_connection)
+				+ REQUEST_HEADER_BUF_START_SIZE
+				+ RESPONSE_BUF_SIZE);
+		if(by_memory < budget) {
+			budget = by_memory > 0 ? by_memory : 1;
+		}
+	}
+
+	return budget;
+}
+
+/* turns away a connection we're over budget for with the prebuilt 503, as
+ * cheaply as we can - one send, then close. we throw away anything the
+ * client has sent already, otherwise closing would reset the connection,
+ * and the client might never see the 503 */
+void shed_connection(int fd) {
+
+	struct date_clock *clock;
+	struct msghdr msg;
+	struct iovec iov[3];
+	char buf[1024];
+
+	clock = loop_clock();
+
+	iov[0].iov_base = overload_response_start;
+	iov[0].iov_len = overload_response_start_length;
+	iov[1].iov_base = clock->date;
+	iov[1].iov_len = clock->date_length;
+	iov[2].iov_base = overload_response_end;
+	iov[2].iov_len = overload_response_end_length;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+
+	read(fd, buf, sizeof(buf));
+
+	if(sendmsg(fd, &msg, 0) > 0) {
+		__atomic_fetch_add(&stats->error_responses, 1,
+				__ATOMIC_RELAXED);
+	}
+
+	shutdown(fd, SHUT_WR);
+	close(fd);
+}
+
+/* closes a connection's socket, giving its place in the budget back */
+void close_connection_socket(int fd) {
+
+	close(fd);
+	__atomic_fetch_sub(&open_connections, 1, __ATOMIC_RELAXED);
+}
+
+/* stops this loop accepting for ACCEPT_PAUSE_MSECS */
+void pause_accepting(void) {
+
+	struct timeval pause;
+
+	pause.tv_sec = ACCEPT_PAUSE_MSECS / 1000;
+	pause.tv_usec = (ACCEPT_PAUSE_MSECS % 1000) * 1000;
+
+	loop_event_del(&this_loop->accept_event);
+	loop_event_add(&accept_resume_event, &pause);
+}
+
+void event_handler_accept_resume(int fd, short event, void *arg) {
+
+	loop_event_add(&this_loop->accept_event, NULL);
+}
+
+/* adds a measurement of how long some queued work waited on this loop, in
+ * msecs. as with CoDel, one short wait means there's no standing queue, so
+ * we stop shedding straight away. we only start once every wait has been
+ * over target for a whole interval. a gap of more than an interval with
+ * nothing queued starts afresh */
+void record_queue_delay(long long delay, long long now) {
+
+	if(now - last_delay_at > QUEUE_DELAY_INTERVAL_MSECS) {
+		above_target_since = 0;
+		overloaded = 0;
+	}
+	last_delay_at = now;
+
+	if(delay <= queue_target_msecs) {
+		above_target_since = 0;
+		overloaded = 0;
+	} else if(above_target_since == 0) {
+		above_target_since = now;
+	} else if(now - above_target_since >= QUEUE_DELAY_INTERVAL_MSECS) {
+		overloaded = 1;
+	}
+}
+
+/* 1 iff work has been waiting too long on this loop, so we should shed new
+ * connections. if nothing's been queued for an interval, it isn't */
+int queue_overloaded(long long now) {
+
+	if(queue_target_msecs == 0) {
+		return 0;
+	}
+
+	if(now - last_delay_at > QUEUE_DELAY_INTERVAL_MSECS) {
+		overloaded = 0;
+	}
+
+	return overloaded;
+}
+
+/* ---------- housekeeping ---------- */
+
+/* timer callback that trims the pools back to what we've needed recently,
+ * then schedules itself again */
+void event_handler_pool_trim(int fd, short event, void *arg) {
+
+	struct timeval interval;
+
+	pool_trim(&connection_pool);
+	pool_trim(&request_buf_pool);
+	pool_trim(&resp_headers_pool);
+	pool_trim(&io_buf_pool);
+	pool_trim(&linger_pool);
+	pool_trim(&file_job_pool);
+	pool_trim(&warm_job_pool);
+
+	interval.tv_sec = POOL_TRIM_INTERVAL_SECS;
+	interval.tv_usec = 0;
+	loop_event_add(&pool_trim_event, &interval);
+}
+
+/* ---------- timeouts ---------- */
+
+/* the wheel tick for a timeout that many seconds from now. we're part way
+ * through the current tick, so round up rather than fire early */
+unsigned long timeout_expiry(int secs) {
+
+	return timer_now() / 1000 + secs + 1;
+}
+
+/* (re)starts the connection's timeout, for the state it's in */
+void set_timeout(struct client_connection *con, int secs) {
+
+	wheel_timer_add(&timeouts, &con->timeout, timeout_expiry(secs));
+}
+
+/* a connection has been idle, slow or stuck for too long, so close it.
+ * anything it had in progress is logged */
+void connection_timed_out(struct wheel_timer *timer) {
+
+	end_connection(timer->arg);
+}
+
+void event_handler_timeout_tick(int fd, short event, void *arg) {
+
+	struct timeval interval;
+
+	timer_wheel_advance(&timeouts, timer_now() / 1000);
+
+	interval.tv_sec = 1;
+	interval.tv_usec = 0;
+	loop_event_add(&timeout_tick_event, &interval);
+}
+
+/* ---------- file jobs ---------- */
+
+/* hands the request's filesystem work to the io threads. if there's a
+ * cached entry for the path, the job just checks it's still good */
+void submit_file_job(struct client_connection *con, const char *path,
+		size_t path_length) {
+
+	struct file_job *job;
+
+	job = pool_alloc(&file_job_pool);
+	if(job == NULL) {
+		release_file(con);
+		prepare_error_code_response(con,
+				RESPONSE_CODE_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	job->io.run = run_file_job;
+	job->io.done = file_job_done;
+	job->con = con;
+
+	memcpy(job->path, path, path_length);
+	job->path[path_length] = '\0';
+	job->path_length = path_length;
+
+	/* copy what we need of the entry, as it belongs to this loop */
+	job->entry_fd = -1;
+	if(con->file_entry != NULL) {
+		job->entry_fd = con->file_entry->fd;
+		job->entry_dev = con->file_entry->dev;
+		job->entry_ino = con->file_entry->ino;
+		job->entry_size = con->file_entry->size;
+		job->entry_last_modified = con->file_entry->last_modified;
+		job->entry_last_modified_nsec =
+			con->file_entry->last_modified_nsec;
+	}
+
+	/* check the request's validators against the cached entry here, as
+	 * the job can't. if the client has the entry's version, the job only
+	 * needs to confirm that it's still the file's */
+	job->entry_not_modified = con->file_entry != NULL
+		&& not_modified(con);
+
+	/* read small bodies for GETs, straight into where they'll be kept.
+	 * for a cached entry, that's a body the cache sets aside for it. for
+	 * a file we've yet to cache, or one that has changed since the
+	 * client's version, the job allocates one for the cache to take on.
+	 * otherwise it's our own buffer, if the body fits */
+	job->body = NULL;
+	job->body_max = 0;
+	job->body_reserved = 0;
+	if(con->method == HTTP_GET && (con->file_entry == NULL
+				|| con->file_entry->body == NULL)) {
+		if(con->file_entry != NULL && !job->entry_not_modified) {
+			job->body = file_cache_reserve_body(con->file_entry);
+		}
+
+		if(job->body != NULL) {
+			job->body_max = con->file_entry->size;
+			job->body_reserved = 1;
+		} else if((con->file_entry == NULL || job->entry_not_modified)
+				&& file_cache_enabled()) {
+			job->body_max = FILE_CACHE_MAX_BODY_SIZE;
+		} else {
+			con->body_buf = pool_alloc(&io_buf_pool);
+			job->body = con->body_buf;
+			job->body_max = job->body == NULL ?
+				0 : INLINE_BODY_MAX_SIZE;
+		}
+	}
+
+	/* If-Modified-Since only counts if there are no entity tags. the
+	 * job can't check those against a file it opens, so it reads the
+	 * body as usual */
+	job->if_modified_since = con->if_none_match_length > 0 ?
+		0 : con->if_modified_since;
+
+	job->entry_valid = 0;
+	job->fd = -1;
+	job->error = 0;
+	job->body_length = 0;
+
+	con->status = WAITING_FOR_FILE_IO;
+	io_pool_submit(&job->io, &this_loop->io_completions);
+}
+
+/* runs on an io thread, so it mustn't touch the connection or the cache */
+void run_file_job(struct io_job *io_job) {
+
+	struct file_job *job = (struct file_job*)io_job;
+	struct stat file_stat;
+	ssize_t bytes_read;
+	time_t last_modified;
+	off_t size;
+	int fd;
+
+	/* if the cached entry is still the same file, we can carry on
+	 * using it */
+	if(job->entry_fd != -1 && stat(job->path, &file_stat) == 0
+			&& file_stat.st_dev == job->entry_dev
+			&& file_stat.st_ino == job->entry_ino
+			&& file_stat.st_size == job->entry_size
+			&& file_stat.st_mtime == job->entry_last_modified
+			&& file_stat.st_mtim.tv_nsec
+			== job->entry_last_modified_nsec) {
+		job->entry_valid = 1;
+		fd = job->entry_fd;
+		size = job->entry_size;
+		last_modified = job->entry_last_modified;
+	} else {
+		job->fd = open_file(job->path, &job->file_stat);
+		if(job->fd == -1) {
+			job->error = errno;
+			return;
+		}
+
+		/* the loop turns away anything but regular files */
+		if(!S_ISREG(job->file_stat.st_mode)) {
+			return;
+		}
+
+		fd = job->fd;
+		size = job->file_stat.st_size;
+		last_modified = job->file_stat.st_mtime;
+	}
+
+	/* read the whole of a small body, unless the client has it. a body
+	 * the cache set aside is only for the entry's version of the file */
+	if(size == 0 || (size_t)size > job->body_max
+			|| (job->body_reserved && !job->entry_valid)
+			|| (job->entry_valid && job->entry_not_modified)
+			|| (job->if_modified_since != 0
+				&& last_modified <= job->if_modified_since)) {
+		return;
+	}
+
+	if(job->body == NULL) {
+		job->body = malloc(sizeof(char) * size);
+		if(job->body == NULL) {
+			return;
+		}
+	}
+
+	while(job->body_length < (size_t)size) {
+		bytes_read = pread(fd, job->body + job->body_length,
+				size - job->body_length, job->body_length);
+
+		if(bytes_read <= 0) {
+			break;
+		}
+
+		job->body_length += bytes_read;
+	}
+
+	/* a short read means the file changed under us, so just send it
+	 * from the file instead */
+	if(job->body_length < (size_t)size) {
+		job->body_length = 0;
+	}
+}
+
+/* back on the loop, finish processing the request with what the io thread
+ * found out */
+void file_job_done(struct io_job *io_job) {
+
+	struct file_job *job = (struct file_job*)io_job;
+	struct client_connection *con = job->con;
+	time_t now = loop_clock()->time;
+
+	/* only the time the job sat waiting for an io thread counts towards
+	 * the loop's queueing delay. how long the disk took doesn't mean
+	 * we're overloaded */
+	record_queue_delay(io_job->started_at - io_job->submitted_at,
+			timer_now());
+
+	/* if the cached entry has changed, stop using it. either way, a
+	 * body the cache set aside is now either loaded or given back */
+	if(con->file_entry != NULL) {
+		file_cache_revalidated(con->file_entry, job->entry_valid,
+				now);
+		if(job->body_reserved) {
+			file_cache_body_loaded(con->file_entry,
+					job->body_length > 0);
+			job->body = NULL;
+		}
+		if(!job->entry_valid) {
+			release_file(con);
+		}
+	}
+
+	/* if there's no cached entry to use, take on the file the job opened,
+	 * as long as it's one we can serve */
+	if(con->file_entry == NULL && job->fd == -1) {
+		prepare_file_error_response(con, job->error);
+	} else if(con->file_entry != NULL || set_request_file(con, job->path,
+				job->path_length, job->fd, &job->file_stat,
+				now)) {
+		use_file_entry(con);
+
+		/* use a body the job read into our own buffer. one it
+		 * allocated goes to the newly cached entry, if the cache has
+		 * room for it. if not, the file's in the page cache now
+		 * anyway */
+		if(job->body_length == (size_t)con->file_size
+				&& job->body_length > 0) {
+			if(job->body == con->body_buf) {
+				con->body = con->body_buf;
+				con->body_length = job->body_length;
+			} else if(con->file_entry != NULL
+					&& file_cache_adopt_body(
+						con->file_entry, job->body)) {
+				job->body = NULL;
+			}
+		}
+
+		prepare_file_response(con);
+	}
+
+	if(job->body != con->body_buf) {
+		free(job->body);
+	}
+	pool_free(&file_job_pool, job);
+
+	start_response(con);
+	write_now(con);
+}
+
+/* 1 iff the file data at the send position is known to be in the page cache,
+ * so sending it won't wait on the disk. readahead brings a file in a window at
+ * a time, so if a probe finds the start there, we take the window after it to
+ * be there too, and don't probe again until we've sent it */
+int file_data_ready(struct client_connection *con) {
+
+	if(con->file_offset < con->file_warmed_end) {
+		return 1;
+	}
+
+	if(!file_data_cached(con)) {
+		return 0;
+	}
+
+	con->file_warmed_end = con->file_offset + RESIDENCY_PROBE_WINDOW;
+	if(con->file_warmed_end > con->file_size) {
+		con->file_warmed_end = con->file_size;
+	}
+
+	return 1;
+}
+
+/* probes whether the file data at the send position is in the page cache, by
+ * reading a byte of it without waiting for the disk. if we can't probe, we
+ * can't tell, so say it isn't, and an io thread reads it for us */
+int file_data_cached(struct client_connection *con) {
+
+#ifdef HAVE_RWF_NOWAIT
+	struct iovec iov;
+	char byte;
+
+	if(__atomic_load_n(&nowait_unsupported, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	/* a short read at the end of the file counts as cached too. the
+	 * send finds out the file has shrunk */
+	if(preadv2(con->file_fd, &iov, 1, con->file_offset, RWF_NOWAIT)
+			>= 0) {
+		return 1;
+	}
+
+	/* kernels before 4.14 refuse nowait reads from files */
+	if(errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS) {
+		__atomic_store_n(&nowait_unsupported, 1, __ATOMIC_RELAXED);
+	}
+#endif
+
+	return 0;
+}
+
+/* has an io thread read the next part of the file into the page cache,
+ * while the connection waits. returns 0 if we couldn't, in which case the
+ * caller should just send it */
+int submit_warm_job(struct client_connection *con, size_t length) {
+
+	struct file_warm_job *job;
+
+	job = pool_alloc(&warm_job_pool);
+	if(job == NULL) {
+		return 0;
+	}
+
+	job->io.run = run_warm_job;
+	job->io.done = warm_job_done;
+	job->con = con;
+	job->fd = con->file_fd;
+	job->offset = con->file_offset;
+	job->length = length;
+	job->length_read = 0;
+
+	/* nothing to write until it's done, and the job holds the connection
+	 * until then */
+	con->status = WAITING_FOR_FILE_IO;
+	loop_event_del(&con->ev_write);
+	wheel_timer_cancel(&con->timeout);
+
+	io_pool_submit(&job->io, &this_loop->io_completions);
+
+	return 1;
+}
+
+/* runs on an io thread. the data itself is thrown away - it's the page cache
+ * we're after. a short read means the file has been truncated */
+void run_warm_job(struct io_job *io_job) {
+
+	static __thread char buf[IO_BUF_SIZE];
+	struct file_warm_job *job = (struct file_warm_job*)io_job;
+	off_t offset = job->offset, end = job->offset + job->length;
+	ssize_t bytes_read;
+	size_t read_size;
+
+	while(offset < end) {
+		read_size = IO_BUF_SIZE;
+		if(end - offset < (off_t)read_size) {
+			read_size = end - offset;
+		}
+
+		bytes_read = pread(job->fd, buf, read_size, offset);
+		if(bytes_read <= 0) {
+			break;
+		}
+
+		offset += bytes_read;
+	}
+
+	job->length_read = offset - job->offset;
+}
+
+/* back on the loop, carry on sending the file */
+void warm_job_done(struct io_job *io_job) {
+
+	struct file_warm_job *job = (struct file_warm_job*)io_job;
+	struct client_connection *con = job->con;
+
+	record_queue_delay(io_job->started_at - io_job->submitted_at,
+			timer_now());
+
+	/* send what was read straight away. if the file ended early, stop the
+	 * body there, and close the connection, as the client won't get all
+	 * that we told it to expect */
+	con->file_warmed_end = job->offset + job->length_read;
+	if(job->length_read < job->length) {
+		con->file_size = con->file_warmed_end;
+		con->keep_alive = 0;
+	}
+
+	pool_free(&warm_job_pool, job);
+
+	con->status = SENDING_RESPONSE_FILE;
+	loop_event_add(&con->ev_write, NULL);
+	write_now(con);
+}
+
+/* ---------- loop threads ---------- */
+
+/* another loop has queued connections it's too busy for */
+void event_handler_wakeup(int fd, short event, void *arg) {
+
+	char buf[64];
+	ssize_t bytes_read;
+	int wakeups = 0;
+
+	/* drain the wakeup pipe. there's a byte for each connection queued
+	 * for us */
+	while((bytes_read = read(fd, buf, sizeof(buf))) > 0) {
+		wakeups += bytes_read;
+	}
+	loop_event_blocked(&this_loop->wakeup_event);
+
+	steal_connections(wakeups);
+}
+
+/* takes queued connections from other loops. we take at least the given
+ * number, one for each time we were woken, so that a queued connection is
+ * never left waiting on a loop that's still busy. after that, we only take
+ * connections from loops that are busier than us */
+void steal_connections(int wanted) {
+
+	struct accepted_connection accepted;
+	int i;
+
+	for(i = 0; i < num_loops; i++) {
+		if(&loops[i] == this_loop) {
+			continue;
+		}
+
+		while((wanted > 0
+				|| loop_load(this_loop) < loop_load(&loops[i]))
+				&& reserve_connection()
+				&& conn_queue_pop(&loops[i].queue,
+					&accepted)) {
+			start_queued_connection(&accepted);
+			wanted--;
+		}
+	}
+}
+
+/* a loop's load is the connections it's serving plus those it's queued */
+unsigned long loop_load(struct event_loop *loop) {
+
+	unsigned long queued;
+
+	queued = __atomic_load_n(&loop->queue.enqueue_pos, __ATOMIC_RELAXED)
+		- __atomic_load_n(&loop->queue.dequeue_pos, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&loop->active_connections, __ATOMIC_RELAXED)
+		+ queued;
+}
+
+struct event_loop* least_loaded_loop(void) {
+
+	struct event_loop *idlest = this_loop;
+	int i;
+
+	for(i = 0; i < num_loops; i++) {
+		if(loop_load(&loops[i]) < loop_load(idlest)) {
+			idlest = &loops[i];
+		}
+	}
+
+	return idlest;
+}
+
+/* asks a loop to steal a connection. the pipe can hold far more wakeups
+ * than the queues can hold connections, so it never fills */
+void wake_loop(struct event_loop *loop) {
+
+	if(write(loop->wakeup_fds[1], "", 1) < 0) {
+		return;
+	}
 }
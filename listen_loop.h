@@ -5,20 +5,49 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <netdb.h>
 #include <err.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <event.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* on linux, file bodies are streamed with sendfile(), which copies straight
+ * from the page cache into the socket. elsewhere we fall back to pread()
+ * through a per-connection buffer */
+#ifdef __linux__
+#define HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+/* accept4() sets the new socket non blocking and close on exec as it's
+ * accepted, saving a couple of fcntl() calls per connection */
+#if defined(__linux__) || defined(SOCK_NONBLOCK)
+#define HAVE_ACCEPT4
+#endif
+
+/* with io threads, file data is checked to be in the page cache before it's
+ * sent. preadv2() with RWF_NOWAIT reads a byte of it, or fails rather than
+ * wait for the disk */
+#if defined(__linux__) && defined(RWF_NOWAIT)
+#define HAVE_RWF_NOWAIT
+#endif
 
 #include "network_setup.h"
 #include "args.h"
 #include "rfc1123_date.h"
 #include "http-parser/http_parser.h"
+#include "conn_queue.h"
+#include "io_pool.h"
+#include "engine.h"
+#include "timer_wheel.h"
 
 /* start with a 1k buffer for incoming requests, and do a doubling realloc
  * if we need more */
@@ -27,23 +56,146 @@
 /* just use a fixed size allocation for the response buffer for now */
 #define RESPONSE_BUF_SIZE (1024)
 
-/* the state of a given client connection. we transition forward */
+/* GET bodies up to this size are read into memory when the request is
+ * processed, so that the headers and the whole body go out together in a
+ * single writev() */
+#define INLINE_BODY_MAX_SIZE (16 * 1024)
+
+/* pooled buffers for in-memory bodies, and for file reads without
+ * sendfile() */
+#define IO_BUF_SIZE (INLINE_BODY_MAX_SIZE)
+
+/* how often we free pooled memory we haven't needed lately */
+#define POOL_TRIM_INTERVAL_SECS (10)
+
+/* the max number of pipelined requests we'll parse ahead of the response
+ * currently being written. any further requests stay in the request buffer
+ * (or the socket) until the queue drains */
+#define PIPELINE_MAX_DEPTH (16)
+
+/* once the file data at the send position is known to be in the page cache,
+ * how much of the file from there we send without checking again. a warm
+ * job reads this much in */
+#define RESIDENCY_PROBE_WINDOW (256 * 1024)
+
+/* with several loop threads, a loop queues newly accepted connections for a
+ * less busy loop to steal once its load is this much more than that loop's */
+#define STEAL_THRESHOLD (4)
+
+/* the most connections we accept each time the listen socket is ready. the
+ * rest wait in the backlog until the next time, so a flood of connections
+ * can't hold up the ones we're already serving */
+#define ACCEPT_BATCH_SIZE (64)
+
+/* fds we keep back from the connection budget, for the listen socket, logs,
+ * pipes, files being opened, and connections we're turning away. the file
+ * cache's fds are kept back on top of this */
+#define FD_RESERVE (64)
+
+/* once we're at the connection budget, new connections get a 503 telling
+ * them to try again after this many seconds */
+#define OVERLOAD_RETRY_AFTER_SECS (5)
+
+/* when we can't accept for lack of fds or memory, we stop trying for this
+ * long rather than spin on the listen socket */
+#define ACCEPT_PAUSE_MSECS (100)
+
+/* a loop measures how long work queues for it - connections in a steal
+ * queue before they start, and file jobs waiting for an io thread to pick
+ * them up. if every wait for this long is more than the queueing delay
+ * target, the loop is overloaded, and sheds new connections until a wait
+ * is short again */
+#define QUEUE_DELAY_INTERVAL_MSECS (100)
+
+/* an event loop thread. a connection stays on the loop that starts it, but a
+ * loop that's much busier than the others queues the connections it accepts,
+ * and wakes the least loaded loop through its wakeup pipe to steal them */
+struct event_loop {
+	pthread_t thread;
+	struct loop_event accept_event;
+
+	/* number of connections the loop is serving, read by other loops */
+	unsigned long active_connections;
+
+	/* connections accepted but not yet started, for this loop or a thief */
+	struct conn_queue queue;
+
+	/* a byte written to the pipe wakes the loop to steal connections */
+	int wakeup_fds[2];
+	struct loop_event wakeup_event;
+
+	/* jobs the io threads have finished for this loop */
+	struct io_completions io_completions;
+};
+
+/* counters for a process's event loops. with worker processes, these live in
+ * memory shared with the parent, which reports on them */
+struct worker_stats {
+	unsigned long connections;
+	unsigned long requests;
+	unsigned long error_responses;
+	unsigned long bytes_sent;
+};
+
+/* the state of a given client connection. we transition forward, except that
+ * a kept-alive connection goes back to NEW_CONNECTION_HEADERS_INCOMPLETE once
+ * its response has been sent. once we shut a connection down, all that's
+ * left of it is a struct lingering_connection */
 enum con_status {
 	NEW_CONNECTION_HEADERS_INCOMPLETE = 0,
 	HEADERS_COMPLETE,
+	WAITING_FOR_FILE_IO,
 	SENDING_ERROR_RESPONSE_CODE,
-	SENDING_RESPONSE_FILE,
-	CLEAN_CONNECTION_SHUTDOWN
+	SENDING_RESPONSE_FILE
 };
 
 enum response_code {
 	RESPONSE_CODE_UNINITIALISED = 0,
 	RESPONSE_CODE_OK = 200,
+	RESPONSE_CODE_NOT_MODIFIED = 304,
 	RESPONSE_CODE_BAD_REQ = 400,
 	RESPONSE_CODE_FORBIDDEN = 403,
 	RESPONSE_CODE_NOT_FOUND = 404,
 	RESPONSE_CODE_METHOD_NOT_ALLOWED = 405,
-	RESPONSE_CODE_INTERNAL_SERVER_ERROR = 500
+	RESPONSE_CODE_INTERNAL_SERVER_ERROR = 500,
+	RESPONSE_CODE_SERVICE_UNAVAILABLE = 503
+};
+
+/* a request parsed from the request buffer, queued until every response
+ * before it on the connection has been sent */
+struct queued_request {
+	enum http_method method;
+
+	/* url data parsed from request, as an offset into the request
+	 * buffer, so it stays valid if the buffer is realloc'd or compacted.
+	 * url_length is 0 if no url has been parsed yet */
+	size_t url_offset; /* this will NOT be null terminated */
+	size_t url_length;
+
+	/* 1 iff the client wants the connection kept after this request */
+	int keep_alive;
+
+	/* the request's If-Modified-Since date, or 0 if it didn't send one
+	 * we can use */
+	time_t if_modified_since;
+
+	/* the request's If-None-Match entity tags, as an offset into the
+	 * request buffer like the url. length is 0 if it didn't send any */
+	size_t if_none_match_offset;
+	size_t if_none_match_length;
+
+	/* set if the request couldn't be parsed, otherwise uninitialised */
+	enum response_code error_code;
+};
+
+/* a connection we've shut down our end of, waiting for the client to close
+ * theirs so that it gets everything we sent. the connection's buffers, file
+ * and parser state are all freed at shutdown, and it's been logged, so this
+ * is all we keep - there can be a lot of slow closing clients */
+struct lingering_connection {
+	int fd;
+	struct loop_event ev_read;
+	struct wheel_timer timeout;
 };
 
 /* state for each client connection, include http parser and libevent state */
@@ -60,22 +212,53 @@ struct client_connection {
 
 	/* incoming data buffer, big enough for a reasonable request.
 	 * If we run out of room in the buffer, we realloc to double the
-	 * size, up to size HTTP_MAX_HEADER_SIZE */
+	 * size, up to size HTTP_MAX_HEADER_SIZE. The parser is only ever
+	 * fed each byte once - request_fed is how many bytes of the buffer
+	 * it has seen so far */
 	int request_buf_size;
 	char *request_buf;
 	int request_buf_bytes_read;
+	int request_fed;
 
 	/* http parser */
 	struct http_parser parser;
 	struct http_parser_settings parser_settings;
 
-	/* url data parsed from request */
-	const char *url; /* this will NOT be null terminated, use url_length */
-	size_t url_length;
+	/* pipelined requests, parsed but not yet responded to. this is a ring
+	 * of pipeline_count requests starting at pipeline_head. the parser
+	 * fills in the slot after the last queued request as it goes.
+	 * pipeline_closed is 1 once we've queued a request after which the
+	 * connection won't be kept, so there's no point parsing further */
+	struct queued_request pipeline[PIPELINE_MAX_DEPTH];
+	int pipeline_head;
+	int pipeline_count;
+	int pipeline_closed;
+
+	/* the request we're currently responding to, taken from the front of
+	 * the pipeline */
+	enum http_method method;
+	size_t url_offset; /* into request_buf, NOT null terminated */
+	size_t url_length; /* 0 if no url */
+	time_t if_modified_since; /* 0 if none */
+	size_t if_none_match_offset; /* into request_buf, like the url */
+	size_t if_none_match_length; /* 0 if none */
+
+	/* the request header the parser is part way through, as offsets
+	 * into request_buf like the url. header_in_value is 1 once the
+	 * parser has moved on to its value */
+	size_t header_field_offset;
+	size_t header_field_length;
+	size_t header_value_offset;
+	size_t header_value_length;
+	int header_in_value;
 
-	/* libevent */
-	struct event ev_read;
-	struct event ev_write;
+	/* events, see engine.h */
+	struct loop_event ev_read;
+	struct loop_event ev_write;
+
+	/* closes the connection if it stays in its current state too long.
+	 * not pending while an io job holds the connection */
+	struct wheel_timer timeout;
 
 	/* We build the response headers once, when libevent first tells
 	 * us we can write.
@@ -91,8 +274,29 @@ struct client_connection {
 	int resp_headers_written;
 	int resp_headers_length;
 
-	/* if we got a valid request, this is the file we're sending */
-	FILE *file_being_sent;
+	/* For cached files, the file specific part of the headers is prebuilt
+	 * in the file cache, and is written straight after resp_headers.
+	 * resp_headers_written counts bytes written across both. Null ptr
+	 * and 0 length if not used */
+	const char *file_headers;
+	int file_headers_length;
+
+	/* if we got a valid request, this is the file we're sending, or -1 */
+	int file_fd;
+
+	/* the file cache entry the fd belongs to, or null ptr if the file
+	 * isn't cached and we opened (and must close) the fd ourselves */
+	struct file_cache_entry *file_entry;
+
+	/* offset of the next body byte to send. we pass this explicitly to
+	 * sendfile() / pread(), so the fd's own file position is never used */
+	off_t file_offset;
+
+	/* the end of the part of the file we know is in the page cache, as an
+	 * io thread has just read it in for us, or a probe found its start
+	 * there. it's sent without checking again, so that we always make
+	 * progress */
+	off_t file_warmed_end;
 
 	/* this is the file size in bytes, determined by a call to fstat() */
 	long file_size;
@@ -100,27 +304,145 @@ struct client_connection {
 	/* This is the optimal read size for the device the file is
 	 * residing on. We get this for each file because files in our mirror
 	 * directory could be on different devices. This is determined by a
-	 * call to fstat() */
+	 * call to fstat(). Only used without sendfile() */
 	int file_read_size;
 
-	/* last modified time of the file, determined by a call to fstat() */
+	/* last modified time and inode of the file, determined by a call to
+	 * fstat(). with the size, these make its entity tag */
 	time_t file_last_modified;
+	long file_last_modified_nsec;
+	ino_t file_ino;
 
-	/* File read buffer, used when streaming data from disk to socket.
-	 * Size of the buffer (in bytes) is equal to file_read_size */
+	/* File read buffer, used when streaming data from disk to socket
+	 * without sendfile(). Size of the buffer (in bytes) is IO_BUF_SIZE,
+	 * and we read up to file_read_size into it at a time. Always null ptr
+	 * if HAVE_SENDFILE */
 	char *file_read_buf;
 
+	/* Small file bodies are held in memory and sent together with the
+	 * headers. body points either at the file cache's copy of the body,
+	 * or at body_buf, which we read ourselves if the file cache couldn't
+	 * hold it. body_length is the number of body bytes held, starting
+	 * from file offset 0, and file_offset tracks how many of them have
+	 * been written. Null ptrs if not used */
+	const char *body;
+	size_t body_length;
+	char *body_buf;
+
 	/* this is the HTTP response code we're sending */
 	enum response_code resp_code;
+
+	/* keep-alive state. keep_alive is 1 iff we'll wait for another
+	 * request once the current response is sent. request_parsed is the
+	 * number of request_buf bytes that make up complete requests, so
+	 * that any bytes after them can be kept for the next one */
+	int keep_alive;
+	int request_parsed;
+	int requests_served;
+
+	/* 1 iff the current request has been written to the access log */
+	int logged;
+};
+
+/* a request's blocking filesystem work, done by an io thread. the path is
+ * resolved, opened and stat'd - or if it's already open in the file cache,
+ * just stat'd to check the cached entry still matches. small bodies are
+ * read as well, so that they can go out with the headers */
+struct file_job {
+	struct io_job io; /* must be first */
+	struct client_connection *con;
+
+	/* a copy of the cached entry to check. entry_fd is -1 if there's no
+	 * cached entry */
+	int entry_fd;
+	dev_t entry_dev;
+	ino_t entry_ino;
+	off_t entry_size;
+	time_t entry_last_modified;
+	long entry_last_modified_nsec;
+
+	/* read bodies up to this size, 0 not to read the body. nor is it
+	 * read if the file hasn't been modified since if_modified_since (0
+	 * for no date) */
+	size_t body_max;
+	time_t if_modified_since;
+
+	/* 1 iff the client has the cached entry's version, so the body isn't
+	 * read if the entry still matches */
+	int entry_not_modified;
+
+	/* where to read the body - the cached entry's body set aside for it
+	 * (body_reserved is 1), or the connection's body_buf. if null ptr,
+	 * the job mallocs one for the cache to take on */
+	char *body;
+	int body_reserved;
+
+	/* results. entry_valid is 1 iff the cached entry still matches,
+	 * otherwise fd is the newly opened file, or -1 with error set to the
+	 * errno. body_length is 0 if the body wasn't read */
+	int entry_valid;
+	int fd;
+	int error;
+	struct stat file_stat;
+	size_t body_length;
+
+	/* full request path, nul terminated */
+	size_t path_length;
+	char path[PATH_MAX];
+};
+
+/* reads part of a file that isn't in the page cache on an io thread, so
+ * that it is by the time we send it */
+struct file_warm_job {
+	struct io_job io; /* must be first */
+	struct client_connection *con;
+	int fd;
+	off_t offset;
+	size_t length;
+
+	/* result - how much of it was read before the end of the file */
+	size_t length_read;
 };
 
-int listen_loop(char*, FILE*, int);
+int listen_loop(struct cl_args*, int, struct worker_stats*);
+int run_loop(struct event_loop*);
+void* loop_thread_main(void*);
 void event_handler_accept(int, short, void*);
+int reserve_connection(void);
+unsigned long connection_budget(struct cl_args*);
+void shed_connection(int);
+void close_connection_socket(int);
+void pause_accepting(void);
+void record_queue_delay(long long, long long);
+int queue_overloaded(long long);
+void event_handler_accept_resume(int, short, void*);
+void start_connection(struct accepted_connection*);
+void start_queued_connection(struct accepted_connection*);
 void event_handler_read(int, short, void*);
 void event_handler_write(int, short, void*);
 int on_url_parsed(http_parser*, const char*, size_t);
+int on_header_field(http_parser*, const char*, size_t);
+int on_header_value(http_parser*, const char*, size_t);
+void header_parsed(struct client_connection*);
 int on_headers_complete(http_parser*);
+int on_message_complete(http_parser*);
+void parse_request_buf(struct client_connection*);
+void queue_request(struct client_connection*, int, enum response_code);
+void start_next_response(struct client_connection*);
+int next_response_ready(struct client_connection*);
 void process_request(struct client_connection*);
+enum response_code request_path(const char*, size_t, char*, size_t*);
+void prepare_file_response(struct client_connection*);
+void use_file_entry(struct client_connection*);
+int open_request_file(struct client_connection*, char*, size_t, time_t);
+int open_file(const char*, struct stat*);
+void prepare_file_error_response(struct client_connection*, int);
+int set_request_file(struct client_connection*, const char*, size_t, int,
+		struct stat*, time_t);
+void release_file(struct client_connection*);
+int not_modified(struct client_connection*);
+int etag_matches(const char*, size_t, const char*, int);
+int file_etag(struct client_connection*, char*);
 void prepare_error_code_response(struct client_connection*,
 		enum response_code);
 int write_common_headers(struct client_connection*);
@@ -128,7 +450,34 @@ void build_error_headers(struct client_connection*);
 void build_file_headers(struct client_connection*);
 int get_file_length(FILE*);
 struct tm* get_last_file_modified_time_gmt(FILE*);
+void read_inline_body(struct client_connection*);
 int write_headers_to_sock(struct client_connection*);
 int write_file_to_sock(struct client_connection*);
+void start_response(struct client_connection*);
+void write_now(struct client_connection*);
+int finish_response(struct client_connection*);
+void reset_connection(struct client_connection*);
 void clean_shutdown(struct client_connection*);
+void free_connection(struct client_connection*);
+void event_handler_linger_read(int, short, void*);
+void linger_timed_out(struct wheel_timer*);
+void end_linger(struct lingering_connection*);
 void end_connection(struct client_connection*);
+void event_handler_pool_trim(int, short, void*);
+unsigned long timeout_expiry(int);
+void set_timeout(struct client_connection*, int);
+void connection_timed_out(struct wheel_timer*);
+void event_handler_timeout_tick(int, short, void*);
+void event_handler_wakeup(int, short, void*);
+void steal_connections(int);
+unsigned long loop_load(struct event_loop*);
+struct event_loop* least_loaded_loop(void);
+void wake_loop(struct event_loop*);
+void submit_file_job(struct client_connection*, const char*, size_t);
+void run_file_job(struct io_job*);
+void file_job_done(struct io_job*);
+int file_data_ready(struct client_connection*);
+int file_data_cached(struct client_connection*);
+int submit_warm_job(struct client_connection*, size_t);
+void run_warm_job(struct io_job*);
+void warm_job_done(struct io_job*);
@@ -2,6 +2,12 @@
 
 #include "network_setup.h"
 
+/* listen socket tuning, set from the command line before any listen
+ * sockets are opened */
+static int listen_backlog = SOMAXCONN;
+static int defer_accept_secs;	/* 0 for off */
+static int fastopen_queue;	/* 0 for off */
+
 struct sockaddr_storage get_listen_address(
 		int address_family, /* from socket.h */
 		char *address,
@@ -83,7 +89,20 @@ void set_flags_non_block(int fd) {
 	}
 }
 
-int setup_listen_socket(struct sockaddr_storage* address) {
+/* sets the listen backlog, how long to hold back new connections until the
+ * client sends something (0 for off) and the queue length for tcp fast open
+ * connections (0 for off) */
+void set_listen_tuning(int backlog, int defer_secs, int fastopen) {
+
+	listen_backlog = backlog;
+	defer_accept_secs = defer_secs;
+	fastopen_queue = fastopen;
+}
+
+/* opens a non blocking listen socket. if reuse_port is set, other sockets can
+ * bind the same address and port, and the kernel balances incoming
+ * connections between them */
+int setup_listen_socket(struct sockaddr_storage* address, int reuse_port) {
 
 	int fd, optVal;
 	size_t sockaddr_size;
@@ -100,6 +119,14 @@ int setup_listen_socket(struct sockaddr_storage* address) {
 		err(1, "setting listen socket option failed");
 	}
 
+#ifdef SO_REUSEPORT
+	/* let each worker bind its own socket to the same port */
+	if(reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optVal,
+				sizeof(int)) < 0) {
+		err(1, "setting listen socket option failed");
+	}
+#endif
+
 	/* listen non blocking */
 	set_flags_non_block(fd);
 
@@ -119,10 +146,44 @@ int setup_listen_socket(struct sockaddr_storage* address) {
 		err(1, "bind failed");
 	}
 
-	/* start listening, queuing the max number of con requests */
-	if(listen(fd, SOMAXCONN) < 0) {
+	/* don't wake us for a connection until its request has arrived, or
+	 * the given number of seconds has passed. on linux that's
+	 * TCP_DEFER_ACCEPT, and on the BSDs an accept filter once we're
+	 * listening. it's only an optimisation, so carry on without it */
+#ifdef TCP_DEFER_ACCEPT
+	if(defer_accept_secs > 0 && setsockopt(fd, IPPROTO_TCP,
+				TCP_DEFER_ACCEPT, &defer_accept_secs,
+				sizeof(int)) < 0) {
+		warn("setting TCP_DEFER_ACCEPT failed");
+	}
+#endif
+
+	/* let returning clients send their request in the SYN */
+#ifdef TCP_FASTOPEN
+	if(fastopen_queue > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+				&fastopen_queue, sizeof(int)) < 0) {
+		warn("setting TCP_FASTOPEN failed");
+	}
+#endif
+
+	/* start listening, queuing up to the backlog's worth of con
+	 * requests. the kernel may cap this further */
+	if(listen(fd, listen_backlog) < 0) {
 		err(1, "listen failed");
 	}
 
+#if defined(SO_ACCEPTFILTER) && !defined(TCP_DEFER_ACCEPT)
+	if(defer_accept_secs > 0) {
+		struct accept_filter_arg filter;
+
+		memset(&filter, 0, sizeof(struct accept_filter_arg));
+		strcpy(filter.af_name, "dataready");
+		if(setsockopt(fd, SOL_SOCKET, SO_ACCEPTFILTER, &filter,
+					sizeof(struct accept_filter_arg)) < 0) {
+			warn("setting accept filter failed");
+		}
+	}
+#endif
+
 	return fd;
 }
@@ -3,6 +3,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <netdb.h>
 #include <err.h>
@@ -16,4 +18,5 @@
 struct sockaddr_storage get_listen_address(int, char*, char*);
 struct sockaddr_storage get_wcard_listen_address(int, char*);
 void set_flags_non_block(int);
-int setup_listen_socket(struct sockaddr_storage*);
+void set_listen_tuning(int, int, int);
+int setup_listen_socket(struct sockaddr_storage*, int);
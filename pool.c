@@ -0,0 +1,84 @@
+/* fixed size object pools, to avoid malloc/free per connection */
+
+#include <string.h>
+
+#include "pool.h"
+
+void pool_init(struct pool *pool, size_t object_size) {
+
+	/* free objects need room for the free list link */
+	if(object_size < sizeof(void*)) {
+		object_size = sizeof(void*);
+	}
+
+	pool->object_size = object_size;
+	pool->free_list = NULL;
+	pool->free_count = 0;
+	pool->in_use = 0;
+	pool->high_water = 0;
+}
+
+/* returns an object from the free list, or a newly malloc'd one if the free
+ * list is empty. returns null ptr on malloc failure */
+void* pool_alloc(struct pool *pool) {
+
+	void *object;
+
+	if(pool->free_list != NULL) {
+		object = pool->free_list;
+		pool->free_list = *(void**)object;
+		pool->free_count--;
+	} else {
+		object = malloc(pool->object_size);
+		if(object == NULL) {
+			return NULL;
+		}
+	}
+
+	pool->in_use++;
+	if(pool->in_use > pool->high_water) {
+		pool->high_water = pool->in_use;
+	}
+
+	return object;
+}
+
+/* as pool_alloc(), with the object zero'd out */
+void* pool_calloc(struct pool *pool) {
+
+	void *object;
+
+	object = pool_alloc(pool);
+	if(object != NULL) {
+		memset(object, 0, pool->object_size);
+	}
+
+	return object;
+}
+
+/* puts an object from pool_alloc() back on the free list */
+void pool_free(struct pool *pool, void *object) {
+
+	*(void**)object = pool->free_list;
+	pool->free_list = object;
+	pool->free_count++;
+
+	pool->in_use--;
+}
+
+/* frees free objects until the pool holds no more objects than the high water
+ * mark since the last trim, then starts a new high water period */
+void pool_trim(struct pool *pool) {
+
+	void *object;
+
+	while(pool->free_count > 0
+			&& pool->in_use + pool->free_count > pool->high_water) {
+		object = pool->free_list;
+		pool->free_list = *(void**)object;
+		pool->free_count--;
+		free(object);
+	}
+
+	pool->high_water = pool->in_use;
+}
@@ -0,0 +1,30 @@
+/* fixed size object pools, to avoid malloc/free per connection - header */
+#pragma once
+
+#include <stdlib.h>
+
+/* a pool of same sized objects. freed objects are kept on a free list and
+ * handed out again, rather than going back to malloc. to stop a burst of
+ * connections pinning memory forever, pool_trim() periodically frees any
+ * free objects beyond what we needed at the busiest point since the last
+ * trim */
+struct pool {
+
+	/* size of each object, at least sizeof(void*) */
+	size_t object_size;
+
+	/* free objects, linked through their first bytes */
+	void *free_list;
+	int free_count;
+
+	/* objects handed out and not yet given back, and the most there have
+	 * been since the last trim */
+	int in_use;
+	int high_water;
+};
+
+void pool_init(struct pool*, size_t);
+void* pool_alloc(struct pool*);
+void* pool_calloc(struct pool*);
+void pool_free(struct pool*, void*);
+void pool_trim(struct pool*);
@@ -1,16 +1,119 @@
 #include "rfc1123_date.h"
 
+/* the clock for the event loop running on this thread. it's updated each
+ * time the loop wakes up, so responses and log records can share one
+ * formatted date per second, instead of each calling gmtime() and
+ * strftime() */
+static __thread struct date_clock current_loop_clock;
+
+static int parse_digits(const char*, int, int*);
+
 /* Writes a RFC1123 date to the given buffer, returning the number of
  * chars written. The date does NOT have a trailing carriage return
  * and newline.
  */
 int write_rfc1123_date(char *buf, time_t t, size_t maxsize) {
 
-	struct tm *gmt;
+	struct tm gmt;
 
-	/* convert unix time to GMT time */
-	gmt = gmtime(&t);
+	/* convert unix time to GMT time. the access log writer thread formats
+	 * dates too, so use the reentrant version */
+	gmtime_r(&t, &gmt);
 
 	return strftime(buf, maxsize, "%a, %d %b %Y %T GMT",
-			gmt);
+			&gmt);
+}
+
+/* Parses a RFC1123 date, as we write them, from a string that needn't be
+ * nul terminated. Returns 1 iff it's valid, with the time in *t. Dates in
+ * the obsolete RFC850 and asctime() formats aren't understood, which the
+ * spec allows - callers just treat them as no date at all.
+ */
+int parse_rfc1123_date(const char *date, size_t length, time_t *t) {
+
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	int day, month, year, hour, min, sec, y, doy;
+	long days;
+
+	/* ignore trailing whitespace */
+	while(length > 0
+			&& (date[length - 1] == ' ' || date[length - 1] == '\t')) {
+		length--;
+	}
+
+	/* "Sun, 06 Nov 1994 08:49:37 GMT". we don't check the day name */
+	if(length != RFC1123_DATE_BUF_SIZE - 1 || date[3] != ','
+			|| date[4] != ' ' || date[7] != ' ' || date[11] != ' '
+			|| date[16] != ' ' || date[19] != ':'
+			|| date[22] != ':'
+			|| memcmp(date + 25, " GMT", 4) != 0) {
+		return 0;
+	}
+
+	for(month = 0; month < 12
+			&& memcmp(months + month * 3, date + 8, 3) != 0;
+			month++);
+
+	if(month == 12
+			|| !parse_digits(date + 5, 2, &day)
+			|| !parse_digits(date + 12, 4, &year)
+			|| !parse_digits(date + 17, 2, &hour)
+			|| !parse_digits(date + 20, 2, &min)
+			|| !parse_digits(date + 23, 2, &sec)
+			|| day < 1 || day > 31 || year < 1970
+			|| hour > 23 || min > 59 || sec > 60) {
+		return 0;
+	}
+
+	/* days since the epoch. counting years from March puts the leap day
+	 * at the end of the year, so the day of the year doesn't depend on
+	 * whether it's a leap year */
+	y = month < 2 ? year - 1 : year;
+	doy = (153 * ((month + 10) % 12) + 2) / 5 + day - 1;
+	days = (long)y * 365 + y / 4 - y / 100 + y / 400 + doy - 719468;
+
+	*t = (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+
+	return 1;
+}
+
+/* sets the clock's time, only formatting the date if the second has changed
+ * since it was last set */
+void date_clock_set(struct date_clock *clock, time_t t) {
+
+	if(clock->date_length > 0 && clock->time == t) {
+		return;
+	}
+
+	clock->time = t;
+	clock->date_length = write_rfc1123_date(clock->date, t,
+			RFC1123_DATE_BUF_SIZE);
+}
+
+/* called when the event loop wakes up, to bring its clock up to date */
+void loop_clock_update(void) {
+
+	date_clock_set(&current_loop_clock, time(NULL));
+}
+
+/* the clock for the event loop on this thread, as of its last update */
+struct date_clock* loop_clock(void) {
+
+	return &current_loop_clock;
+}
+
+/* parses exactly n decimal digits. returns 1 iff they're all digits */
+static int parse_digits(const char *s, int n, int *value) {
+
+	int i;
+
+	*value = 0;
+	for(i = 0; i < n; i++) {
+		if(s[i] < '0' || s[i] > '9') {
+			return 0;
+		}
+		*value = *value * 10 + (s[i] - '0');
+	}
+
+	return 1;
 }
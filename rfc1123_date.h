@@ -2,6 +2,22 @@
 #pragma once
 
 #include <stddef.h>
+#include <string.h>
 #include <time.h>
 
+/* "Sun, 06 Nov 1994 08:49:37 GMT" plus nul */
+#define RFC1123_DATE_BUF_SIZE (30)
+
+/* a time, with its rfc1123 formatting kept alongside so that it only needs
+ * formatting again once the second changes */
+struct date_clock {
+	time_t time;
+	char date[RFC1123_DATE_BUF_SIZE];
+	int date_length;
+};
+
 int write_rfc1123_date(char*, time_t, size_t);
+int parse_rfc1123_date(const char*, size_t, time_t*);
+void date_clock_set(struct date_clock*, time_t);
+void loop_clock_update(void);
+struct date_clock* loop_clock(void);
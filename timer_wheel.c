@@ -0,0 +1,159 @@
+/* hierarchical timing wheel, for connection timeouts.
+ *
+ * this is the classic cascading wheel. a timer due within a level's span
+ * of now sits in that level's slot for its tick. each time level 0 wraps
+ * round, the next slot of level 1 is emptied back into the wheel, which
+ * spreads its timers out over level 0, and so on up the levels. the
+ * timers due on a tick are always in level 0 by the time it's run */
+
+#include "timer_wheel.h"
+
+static void list_init(struct wheel_timer*);
+static void list_append(struct wheel_timer*, struct wheel_timer*);
+static void cascade(struct timer_wheel*, int, int);
+
+/* sets up an empty wheel, starting at the given tick */
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long now) {
+
+	int level, slot;
+
+	wheel->now = now;
+
+	for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for(slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			list_init(&wheel->slots[level][slot]);
+		}
+	}
+}
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_timer_fn fn,
+		void *arg) {
+
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->fn = fn;
+	timer->arg = arg;
+	timer->pending = 0;
+}
+
+/* (re)schedules a timer to fire on the given tick. a tick that's already
+ * passed fires on the next advance */
+void wheel_timer_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+		unsigned long expires) {
+
+	unsigned long delta;
+	int level;
+
+	wheel_timer_cancel(timer);
+
+	if((long)(expires - wheel->now) < 0) {
+		expires = wheel->now;
+	}
+
+	/* anything further off than the wheel reaches fires as late as it
+	 * can instead */
+	delta = expires - wheel->now;
+	if(delta >= 1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+		delta = (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+		expires = wheel->now + delta;
+	}
+
+	/* find the lowest level that spans it */
+	for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if(delta < 1UL << (TIMER_WHEEL_BITS * (level + 1))) {
+			break;
+		}
+	}
+
+	timer->expires = expires;
+	timer->pending = 1;
+	list_append(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS
+				* level)) & TIMER_WHEEL_MASK], timer);
+}
+
+void wheel_timer_cancel(struct wheel_timer *timer) {
+
+	if(!timer->pending) {
+		return;
+	}
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->pending = 0;
+}
+
+/* runs every tick up to and including the given one, firing the timers
+ * due on each. a timer's callback may add or cancel any timer, including
+ * its own */
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long to) {
+
+	struct wheel_timer due, *timer;
+	int level, slot;
+
+	while((long)(to - wheel->now) >= 0) {
+		slot = wheel->now & TIMER_WHEEL_MASK;
+
+		/* when a level wraps, bring down the next slot of the level
+		 * above, and so on up while those wrap too */
+		if(slot == 0) {
+			for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				cascade(wheel, level, (wheel->now
+						>> (TIMER_WHEEL_BITS * level))
+						& TIMER_WHEEL_MASK);
+				if(((wheel->now >> (TIMER_WHEEL_BITS * level))
+						& TIMER_WHEEL_MASK) != 0) {
+					break;
+				}
+			}
+		}
+
+		/* take this tick's timers, and move on before firing them, so
+		 * anything they add for now lands in the next tick's slot */
+		list_init(&due);
+		if(wheel->slots[0][slot].next != &wheel->slots[0][slot]) {
+			due.next = wheel->slots[0][slot].next;
+			due.prev = wheel->slots[0][slot].prev;
+			due.next->prev = &due;
+			due.prev->next = &due;
+			list_init(&wheel->slots[0][slot]);
+		}
+
+		wheel->now++;
+
+		while(due.next != &due) {
+			timer = due.next;
+			wheel_timer_cancel(timer);
+			timer->fn(timer);
+		}
+	}
+}
+
+/* ---------- internals ---------- */
+
+static void list_init(struct wheel_timer *head) {
+
+	head->next = head;
+	head->prev = head;
+}
+
+static void list_append(struct wheel_timer *head, struct wheel_timer *timer) {
+
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+/* empties a slot back into the wheel, where its timers land in lower
+ * levels now they're closer */
+static void cascade(struct timer_wheel *wheel, int level, int slot) {
+
+	struct wheel_timer *head = &wheel->slots[level][slot], *timer;
+
+	while(head->next != head) {
+		timer = head->next;
+		wheel_timer_add(wheel, timer, timer->expires);
+	}
+}
@@ -0,0 +1,42 @@
+/* hierarchical timing wheel, for connection timeouts - header */
+#pragma once
+
+#include <stdlib.h>
+
+/* each level has 2^TIMER_WHEEL_BITS slots, and each slot of a level covers
+ * as many ticks as the whole of the level below it. with a tick of a
+ * second, 4 levels of 64 slots reach over 194 days */
+#define TIMER_WHEEL_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS (4)
+
+struct wheel_timer;
+
+typedef void (*wheel_timer_fn)(struct wheel_timer*);
+
+/* a timer, embedded in whatever it times out. adding, cancelling and
+ * rescheduling are all O(1), however many timers there are */
+struct wheel_timer {
+	struct wheel_timer *next;	/* slot list */
+	struct wheel_timer *prev;
+	unsigned long expires;	/* tick to fire on */
+	wheel_timer_fn fn;
+	void *arg;
+	int pending;	/* 1 iff in the wheel */
+};
+
+/* the slots are list heads. timers only ever wait in the lowest level
+ * that can tell their tick apart from now, and move down a level each time
+ * the level below wraps round */
+struct timer_wheel {
+	unsigned long now;	/* the next tick to run */
+	struct wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel*, unsigned long);
+void wheel_timer_init(struct wheel_timer*, wheel_timer_fn, void*);
+void wheel_timer_add(struct timer_wheel*, struct wheel_timer*,
+		unsigned long);
+void wheel_timer_cancel(struct wheel_timer*);
+void timer_wheel_advance(struct timer_wheel*, unsigned long);
@@ -0,0 +1,259 @@
+/* pre-forked worker processes, one event loop each.
+ *
+ * a single event loop tops out at one core, so with -w the parent forks that
+ * many workers, each running its own listen_loop(). every worker gets its own
+ * SO_REUSEPORT listen socket, so the kernel spreads incoming connections
+ * across them and there's no thundering herd on one accept queue. the parent
+ * just supervises - it restarts workers that die, forwards SIGHUP so they
+ * reopen the access log, and on SIGUSR1 (and at shutdown) reports the
+ * workers' counters, which live in memory shared with the workers. */
+
+#include "workers.h"
+
+static struct cl_args *args;
+static int num_workers;
+
+/* per worker listen socket, pid (0 if not running) and start time. the
+ * listen sockets stay open in the parent, so a restarted worker picks up
+ * the connections queued on its socket */
+static int *listen_fds;
+static pid_t *pids;
+static time_t *start_times;
+
+/* per worker counters, shared with the workers */
+static struct worker_stats *stats;
+
+/* set by signal handlers, acted on by the supervisor loop */
+static volatile sig_atomic_t report_requested;
+static volatile sig_atomic_t reopen_requested;
+static volatile sig_atomic_t stop_requested;
+
+static void start_worker(int);
+static void report_stats(void);
+static void report_line(int, const char*, ...);
+static void handle_signal(int);
+
+/* opens a listen socket for each worker, and the shared memory for their
+ * counters. this is done before daemonising, so that errors are seen */
+void workers_listen(struct cl_args *cl_args, struct sockaddr_storage *addr) {
+
+	int i;
+
+	args = cl_args;
+	num_workers = cl_args->workers;
+
+	listen_fds = calloc(num_workers, sizeof(int));
+	pids = calloc(num_workers, sizeof(pid_t));
+	start_times = calloc(num_workers, sizeof(time_t));
+	if(listen_fds == NULL || pids == NULL || start_times == NULL) {
+		err(1, "allocating worker state failed");
+	}
+
+	for(i = 0; i < num_workers; i++) {
+#ifdef SO_REUSEPORT
+		listen_fds[i] = setup_listen_socket(addr, 1);
+#else
+		/* no SO_REUSEPORT, so the workers all accept from one
+		 * socket */
+		listen_fds[i] = i == 0 ? setup_listen_socket(addr, 0)
+			: listen_fds[0];
+#endif
+	}
+
+	stats = mmap(NULL, sizeof(struct worker_stats) * num_workers,
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+	if(stats == MAP_FAILED) {
+		err(1, "mapping worker stats failed");
+	}
+	memset(stats, 0, sizeof(struct worker_stats) * num_workers);
+}
+
+/* starts the workers and supervises them until SIGTERM or SIGINT */
+int run_workers(void) {
+
+	struct sigaction sa;
+	pid_t pid;
+	int i, status;
+
+	for(i = 0; i < num_workers; i++) {
+		start_worker(i);
+	}
+
+	/* no SA_RESTART, so waitpid() returns to act on signals */
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = handle_signal;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGUSR1, &sa, NULL) < 0
+			|| sigaction(SIGTERM, &sa, NULL) < 0
+			|| sigaction(SIGINT, &sa, NULL) < 0
+			|| (args->access_log_file != NULL
+				&& sigaction(SIGHUP, &sa, NULL) < 0)) {
+		err(1, "installing signal handlers failed");
+	}
+
+	while(!stop_requested) {
+		pid = waitpid(-1, &status, 0);
+
+		if(pid == -1 && errno != EINTR) {
+			err(1, "waiting for workers failed");
+		}
+
+		/* restart a worker that's died. if it died straight away,
+		 * it'll probably do so again, so don't spin */
+		for(i = 0; pid > 0 && i < num_workers; i++) {
+			if(pids[i] == pid) {
+				pids[i] = 0;
+				if(time(NULL) - start_times[i] < 1) {
+					sleep(1);
+				}
+				if(!stop_requested) {
+					start_worker(i);
+				}
+			}
+		}
+
+		if(report_requested) {
+			report_requested = 0;
+			report_stats();
+		}
+
+		/* reopen our copy of the access log, and have the workers
+		 * reopen theirs */
+		if(reopen_requested) {
+			reopen_requested = 0;
+			if(freopen(args->access_log_path, "a",
+						args->access_log_file)
+					== NULL) {
+				err(1, "reopening access log failed");
+			}
+			for(i = 0; i < num_workers; i++) {
+				if(pids[i] > 0) {
+					kill(pids[i], SIGHUP);
+				}
+			}
+		}
+	}
+
+	/* stop the workers, and report what they did */
+	for(i = 0; i < num_workers; i++) {
+		if(pids[i] > 0) {
+			kill(pids[i], SIGTERM);
+		}
+	}
+	for(i = 0; i < num_workers; i++) {
+		if(pids[i] > 0) {
+			waitpid(pids[i], &status, 0);
+		}
+	}
+
+	report_stats();
+
+	return 0;
+}
+
+/* ---------- internals ---------- */
+
+static void start_worker(int worker) {
+
+	struct sigaction sa;
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if(pid == -1) {
+		warn("starting worker %d failed", worker);
+		return;
+	}
+
+	if(pid > 0) {
+		pids[worker] = pid;
+		start_times[worker] = time(NULL);
+		return;
+	}
+
+	/* in the worker. put back the signal handling the parent changed */
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	/* we only accept from our own socket */
+	for(i = 0; i < num_workers; i++) {
+		if(listen_fds[i] != listen_fds[worker]) {
+			close(listen_fds[i]);
+		}
+	}
+
+	listen_loop(args, listen_fds[worker], &stats[worker]);
+
+	/* the loop only returns on error */
+	_exit(1);
+}
+
+/* writes each worker's counters, and their totals, to the access log if
+ * there is one, otherwise stderr. the workers are appending to the same log,
+ * so each line goes out in its own write() to keep it whole */
+static void report_stats(void) {
+
+	struct worker_stats total;
+	int fd, i;
+
+	fd = args->access_log_file != NULL ? fileno(args->access_log_file)
+		: STDERR_FILENO;
+
+	memset(&total, 0, sizeof(struct worker_stats));
+
+	for(i = 0; i < num_workers; i++) {
+		report_line(fd, "# worker %d: %lu connections, %lu requests, "
+				"%lu errors, %lu bytes sent\n", i,
+				stats[i].connections, stats[i].requests,
+				stats[i].error_responses, stats[i].bytes_sent);
+
+		total.connections += stats[i].connections;
+		total.requests += stats[i].requests;
+		total.error_responses += stats[i].error_responses;
+		total.bytes_sent += stats[i].bytes_sent;
+	}
+
+	report_line(fd, "# all workers: %lu connections, %lu requests, "
+			"%lu errors, %lu bytes sent\n", total.connections,
+			total.requests, total.error_responses,
+			total.bytes_sent);
+}
+
+/* formats a report line and writes it to fd in one go */
+static void report_line(int fd, const char *format, ...) {
+
+	char line[REPORT_LINE_SIZE];
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(line, REPORT_LINE_SIZE, format, ap);
+	va_end(ap);
+
+	if(len >= REPORT_LINE_SIZE) {
+		len = REPORT_LINE_SIZE - 1;
+	}
+	if(len > 0 && write(fd, line, len) < 0) {
+		warn("writing worker report failed");
+	}
+}
+
+static void handle_signal(int sig) {
+
+	switch(sig) {
+		case SIGUSR1:
+			report_requested = 1;
+			break;
+		case SIGHUP:
+			reopen_requested = 1;
+			break;
+		default:
+			stop_requested = 1;
+			break;
+	}
+}
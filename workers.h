@@ -0,0 +1,23 @@
+/* pre-forked worker processes, one event loop each - header */
+#pragma once
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "args.h"
+#include "listen_loop.h"
+#include "network_setup.h"
+
+/* the longest line report_stats() writes */
+#define REPORT_LINE_SIZE (256)
+
+void workers_listen(struct cl_args*, struct sockaddr_storage*);
+int run_workers(void);